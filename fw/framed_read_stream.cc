@@ -0,0 +1,203 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/framed_read_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mjlib/base/assert.h"
+
+namespace micro = mjlib::micro;
+
+namespace fw {
+
+namespace {
+uint16_t Crc16(const uint8_t* data, int size) {
+  uint16_t crc = 0xffff;
+  for (int i = 0; i < size; i++) {
+    crc ^= static_cast<uint16_t>(data[i]) << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+/// Return the decoded size, or -1 if the input is not valid COBS.
+int CobsDecode(const uint8_t* input, int size, uint8_t* output) {
+  int in_pos = 0;
+  int out_pos = 0;
+  while (in_pos < size) {
+    const uint8_t code = input[in_pos++];
+    if (code == 0) { return -1; }
+    for (int i = 1; i < code; i++) {
+      if (in_pos >= size) { return -1; }
+      output[out_pos++] = input[in_pos++];
+    }
+    if (code < 0xff && in_pos < size) {
+      output[out_pos++] = 0;
+    }
+  }
+  return out_pos;
+}
+}
+
+FramedReadStream::FramedReadStream(micro::AsyncReadStream* base)
+    : base_(base) {}
+
+void FramedReadStream::AsyncReadSome(const mjlib::base::string_span& data,
+                                     const micro::SizeCallback& callback) {
+  MJ_ASSERT(!read_callback_);
+
+  // This is satisfied from Poll, so that a callback which starts the
+  // next read does not recurse.
+  read_callback_ = callback;
+  read_data_ = data;
+}
+
+void FramedReadStream::SetFrameHandler(FrameHandler handler) {
+  frame_handler_ = handler;
+}
+
+void FramedReadStream::SetBinary(bool binary) {
+  binary_ = binary;
+  frame_size_ = 0;
+  frame_overflow_ = false;
+}
+
+void FramedReadStream::Poll() {
+  if (payload_pending_) {
+    if (!frame_handler_(std::string_view(payload_, payload_size_))) {
+      return;
+    }
+    payload_pending_ = false;
+  }
+
+  ProcessInput();
+  StartRead();
+}
+
+int FramedReadStream::EncodeFrame(std::string_view payload, char* output) {
+  MJ_ASSERT(static_cast<int>(payload.size()) <= kMaxPayloadSize);
+
+  uint8_t frame[kMaxFrameSize] = {};
+  std::memcpy(frame, payload.data(), payload.size());
+  int size = payload.size();
+  const uint16_t crc = Crc16(frame, size);
+  frame[size++] = crc & 0xff;
+  frame[size++] = crc >> 8;
+
+  // Frames are shorter than 254 bytes, so there is never more than
+  // one code byte in a row without data.
+  auto* const out = reinterpret_cast<uint8_t*>(output);
+  int code_pos = 0;
+  int out_pos = 1;
+  uint8_t code = 1;
+  for (int i = 0; i < size; i++) {
+    if (frame[i] == 0) {
+      out[code_pos] = code;
+      code_pos = out_pos++;
+      code = 1;
+    } else {
+      out[out_pos++] = frame[i];
+      code++;
+    }
+  }
+  out[code_pos] = code;
+  out[out_pos++] = 0;
+
+  return out_pos;
+}
+
+void FramedReadStream::StartRead() {
+  if (read_outstanding_ || payload_pending_) { return; }
+  if (input_pos_ < input_size_) { return; }
+
+  read_outstanding_ = true;
+  input_pos_ = 0;
+  input_size_ = 0;
+  base_->AsyncReadSome(
+      mjlib::base::string_span(input_, sizeof(input_)),
+      [this](micro::error_code, std::size_t size) {
+        read_outstanding_ = false;
+        input_pos_ = 0;
+        input_size_ = size;
+      });
+}
+
+void FramedReadStream::ProcessInput() {
+  while (input_pos_ < input_size_) {
+    if (!binary_) {
+      if (!read_callback_) { return; }
+
+      const int count = std::min<int>(
+          input_size_ - input_pos_, read_data_.size());
+      std::memcpy(read_data_.data(), &input_[input_pos_], count);
+      input_pos_ += count;
+
+      auto copy = read_callback_;
+      read_callback_ = {};
+      read_data_ = {};
+      copy(micro::error_code(), count);
+      continue;
+    }
+
+    const uint8_t byte = input_[input_pos_++];
+    if (byte != 0) {
+      if (frame_size_ < static_cast<int>(sizeof(frame_))) {
+        frame_[frame_size_++] = byte;
+      } else {
+        frame_overflow_ = true;
+      }
+      continue;
+    }
+
+    HandleFrame();
+    if (payload_pending_) { return; }
+  }
+}
+
+void FramedReadStream::HandleFrame() {
+  uint8_t decoded[kMaxEncodedSize] = {};
+  const int size =
+      frame_overflow_ ? -1 : CobsDecode(frame_, frame_size_, decoded);
+  frame_size_ = 0;
+  frame_overflow_ = false;
+
+  // Empty frames are ignored, so a host can send a few zeros to get
+  // back in sync.
+  if (size == 0) { return; }
+  if (size < 3 || size > kMaxFrameSize) {
+    stats_.framing_errors++;
+    return;
+  }
+
+  const uint16_t expected = decoded[size - 2] | (decoded[size - 1] << 8);
+  if (Crc16(decoded, size - 2) != expected) {
+    stats_.crc_errors++;
+    return;
+  }
+  stats_.frames++;
+
+  payload_size_ = size - 2;
+  std::memcpy(payload_, decoded, payload_size_);
+  if (!frame_handler_ ||
+      frame_handler_(std::string_view(payload_, payload_size_))) {
+    return;
+  }
+  payload_pending_ = true;
+}
+
+}
@@ -0,0 +1,110 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <string_view>
+
+#include "mjlib/base/visitor.h"
+#include "mjlib/micro/async_stream.h"
+#include "mjlib/micro/static_function.h"
+
+namespace fw {
+
+/// Sits between the host stream and CommandManager.  In text mode,
+/// the default, everything is passed through unchanged.  In binary
+/// mode, the input is instead decoded as COBS frames, each terminated
+/// by a 0 byte and ending in a CRC-16/CCITT-FALSE of the rest in
+/// little endian, and each valid frame is handed to the frame
+/// handler.
+class FramedReadStream : public mjlib::micro::AsyncReadStream {
+ public:
+  /// The largest decoded frame, including the CRC.
+  static constexpr int kMaxFrameSize = 64;
+  /// The largest payload which can be sent with EncodeFrame.
+  static constexpr int kMaxPayloadSize = kMaxFrameSize - 2;
+  /// The most bytes EncodeFrame can produce.
+  static constexpr int kMaxEncodedSize = kMaxFrameSize + 2;
+
+  /// Invoked with the payload of each binary frame which passed its
+  /// CRC.  Returning false causes it to be offered again from a later
+  /// Poll, and no more input is read until it is accepted.
+  using FrameHandler = mjlib::micro::StaticFunction<bool(std::string_view)>;
+
+  struct Stats {
+    uint32_t frames = 0;
+    uint32_t crc_errors = 0;
+    /// Frames which were not valid COBS or were too long.
+    uint32_t framing_errors = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(frames));
+      a->Visit(MJ_NVP(crc_errors));
+      a->Visit(MJ_NVP(framing_errors));
+    }
+  };
+
+  FramedReadStream(mjlib::micro::AsyncReadStream* base);
+
+  void AsyncReadSome(const mjlib::base::string_span&,
+                     const mjlib::micro::SizeCallback&) override;
+
+  void SetFrameHandler(FrameHandler);
+
+  /// Switch between text and binary mode.  Any input already read
+  /// from the base stream is interpreted in the new mode.
+  void SetBinary(bool);
+  bool binary() const { return binary_; }
+
+  void Poll();
+
+  /// Add a CRC to @p payload, COBS encode it and terminate it with a
+  /// 0 byte.  @p output must have room for kMaxEncodedSize bytes.
+  /// Return the encoded size.
+  static int EncodeFrame(std::string_view payload, char* output);
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  void StartRead();
+  void ProcessInput();
+  void HandleFrame();
+
+  mjlib::micro::AsyncReadStream* const base_;
+  FrameHandler frame_handler_;
+  bool binary_ = false;
+
+  char input_[64] = {};
+  int input_pos_ = 0;
+  int input_size_ = 0;
+  bool read_outstanding_ = false;
+
+  mjlib::micro::SizeCallback read_callback_;
+  mjlib::base::string_span read_data_;
+
+  // The frame being received, still COBS encoded.
+  uint8_t frame_[kMaxEncodedSize] = {};
+  int frame_size_ = 0;
+  bool frame_overflow_ = false;
+
+  // A decoded payload the handler has not accepted yet.
+  char payload_[kMaxFrameSize] = {};
+  int payload_size_ = 0;
+  bool payload_pending_ = false;
+
+  Stats stats_;
+};
+
+}
@@ -21,6 +21,7 @@ namespace fw {
 class MillisecondTimer {
 public:
   MillisecondTimer() {
+    __HAL_RCC_TIM5_CLK_ENABLE();
     __HAL_RCC_TIM4_CLK_ENABLE();
     __HAL_RCC_TIM3_CLK_ENABLE();
 
@@ -45,12 +46,31 @@ public:
 
     HAL_TIM_Base_Init(&handle4_);
     HAL_TIM_Base_Start(&handle4_);
+
+    // TIM5 is a 32 bit timer, so it can provide a free running
+    // microsecond clock that only wraps every 71 minutes.
+    handle5_.Instance = TIM5;
+    handle5_.Init.Period = 0xFFFFFFFF;
+    handle5_.Init.Prescaler =
+        (uint32_t)(2 * HAL_RCC_GetPCLK1Freq() / 1000000U) - 1;  // 1 us tick
+    handle5_.Init.ClockDivision = 0;
+    handle5_.Init.CounterMode = TIM_COUNTERMODE_UP;
+    handle5_.Init.RepetitionCounter = 0;
+
+    HAL_TIM_Base_Init(&handle5_);
+    HAL_TIM_Base_Start(&handle5_);
   }
 
   uint32_t read_ms() {
     return TIM4->CNT;
   }
 
+  /// Return a free running 32 bit microsecond counter.  This may be
+  /// called from interrupt context.
+  uint32_t read_us() {
+    return TIM5->CNT;
+  }
+
   void wait_ms(uint32_t delay_ms) {
     uint32_t current = TIM4->CNT;
     uint32_t elapsed = 0;
@@ -79,6 +99,7 @@ public:
 private:
   TIM_HandleTypeDef handle3_ = {};
   TIM_HandleTypeDef handle4_ = {};
+  TIM_HandleTypeDef handle5_ = {};
 };
 
 }
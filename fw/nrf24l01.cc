@@ -14,48 +14,95 @@
 
 #include "fw/nrf24l01.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include "mjlib/base/string_span.h"
 
 namespace fw {
 
-Nrf24l01::SpiMaster::SpiMaster(SPI* spi, PinName cs, MillisecondTimer* timer)
-    : spi_(spi), cs_(cs, 1), timer_(timer) {
+namespace {
+// These are changed by the device itself, so they cannot be cached.
+bool IsVolatileRegister(uint8_t address) {
+  return address == 0x07 ||  // STATUS
+      address == 0x08 ||  // OBSERVE_TX
+      address == 0x09 ||  // RPD
+      address == 0x17;  // FIFO_STATUS
+}
+
+// These are written by SelectRfChannel and SelectId, which may run
+// from an interrupt, so the main loop cannot read them back without
+// racing a hop.  Each hop rewrites them anyway.
+bool IsHopRegister(uint8_t address) {
+  return address == 0x05 ||  // RF_CH
+      address == 0x0a ||  // RX_ADDR_P0
+      address == 0x10;  // TX_ADDR
+}
+
+// FIFO_STATUS only says whether the 3 deep TX FIFO is empty or full.
+// In between, it holds 1 or 2, and we assume 2 so that nothing is
+// reported sent early.  Anything left over is accounted for by a
+// later event.
+uint32_t TxFifoDepth(uint8_t fifo_status) {
+  if (fifo_status & (1 << 4)) { return 0; }  // TX_EMPTY
+  if (fifo_status & (1 << 5)) { return 3; }  // TX_FULL
+  return 2;
+}
+}
+
+Nrf24l01::SpiMaster::SpiMaster(PinName cs, MillisecondTimer* timer)
+    : dma_(cs), timer_(timer) {
 }
 
 uint8_t Nrf24l01::SpiMaster::Command(
     uint8_t command,
     std::string_view data_in,
     mjlib::base::string_span data_out) {
-  cs_.write(0);
-
-  // The nrf24l01 has a 38ns CS setup time.  8 nops should get us
-  // that for any stm32 frequency.
-  asm("nop");
-  asm("nop");
-  asm("nop");
-  asm("nop");
-  asm("nop");
-  asm("nop");
-  asm("nop");
-  asm("nop");
-
-  const uint8_t status = spi_->write(command);
-
-  const auto to_transfer =
-      std::max<std::size_t>(data_in.size(), data_out.size());
-  for (size_t i = 0; i < to_transfer; i++) {
-    const uint8_t out_byte = spi_->write(
-        (i < data_in.size()) ? data_in[i] : 0);
-    if (i < static_cast<std::size_t>(data_out.size())) {
-      data_out[i] = out_byte;
-    }
-  }
+  volatile bool done = false;
+  uint8_t status = 0;
 
-  cs_.write(1);
+  AsyncCommand(command, data_in, data_out, [&](uint8_t result) {
+      status = result;
+      done = true;
+    });
+
+  while (!done);
 
   return status;
 }
 
+void Nrf24l01::SpiMaster::AsyncCommand(
+    uint8_t command,
+    std::string_view data_in,
+    mjlib::base::string_span data_out,
+    const Stm32G4DmaSpi::Callback& callback) {
+  Stm32G4DmaSpi::Transaction transaction;
+  transaction.command = command;
+  transaction.tx = data_in;
+  transaction.rx = data_out;
+  transaction.callback = callback;
+
+  // If the queue is full, wait for the DMA engine to make some
+  // progress.  This is only ever called from contexts the DMA
+  // interrupt can preempt.
+  while (!dma_.Queue(transaction));
+}
+
+void Nrf24l01::SpiMaster::IrqCommand(
+    uint8_t command,
+    std::string_view data_in,
+    mjlib::base::string_span data_out,
+    const Stm32G4DmaSpi::Callback& callback) {
+  Stm32G4DmaSpi::Transaction transaction;
+  transaction.command = command;
+  transaction.tx = data_in;
+  transaction.rx = data_out;
+  transaction.callback = callback;
+
+  const bool queued = dma_.Queue(transaction, true);
+  MJ_ASSERT(queued);
+}
+
 uint8_t Nrf24l01::SpiMaster::WriteRegister(uint8_t address, std::string_view data) {
   return Command(0x20 + address, data, {});
 }
@@ -98,39 +145,221 @@ Nrf24l01::Nrf24l01(MillisecondTimer* timer, const Options& options)
     : timer_(timer),
       options_(options),
       spi_(options.pins.mosi, options.pins.miso, options.pins.sck),
-      nrf_(&spi_, options.pins.cs, timer),
+      nrf_(options.pins.cs, timer),
       irq_(options.pins.irq),
-      ce_(options.pins.ce, 0) {
+      ce_(options.pins.ce, 0, 10),
+      rx_queue_depth_(std::max(1, std::min(kMaxRxQueueDepth,
+                                           options.rx_queue_depth))) {
   spi_.frequency(10000000);
+
+  irq_.fall(callback(this, &Nrf24l01::HandleIrq));
 }
 
-Nrf24l01::~Nrf24l01() {}
+Nrf24l01::~Nrf24l01() {
+  irq_.fall(nullptr);
+}
 
 void Nrf24l01::Poll() {
-  if (irq_.read() == 0) {
-    // We have some interrupt to deal with.  Read the status.
-    const uint8_t status = nrf_.Command(0xff, {}, {});
+  event_queue_.Poll();
+
+  // The EXTI interrupt only fires on the falling edge.  If the line
+  // is still asserted, because we were busy when it fell, then pick
+  // it up here.  Also, packets left in the RX FIFO do not raise a
+  // new interrupt once RX_DR has been cleared.
+  if (irq_.read() == 0 || (rx_fifo_pending_ && !rx_queue_full())) {
+    StartIrqSequence(timer_->read_us());
+  }
+}
 
-    if (status & (1 << 6)) {
-      ReadPacket();
+void Nrf24l01::HandleIrq() {
+  StartIrqSequence(timer_->read_us());
+}
 
-      if (is_data_ready_) { rx_overflow_ = true; }
-      is_data_ready_ = true;
-    }
-    if (status & (1 << 4)) {
-      // Retransmit count exceeded!
-      retransmit_exceeded_++;
+// The IRQ sequence below has at most 3 transactions outstanding at
+// once: the RX payload or flush, the TX flush, and the STATUS write.
+static_assert(Stm32G4DmaSpi::kReservedSize >= 3);
 
-      // Flush our TX FIFO.
-      nrf_.Command(0xe1, {}, {});
-    }
+void Nrf24l01::StartIrqSequence(uint32_t timestamp_us) {
+  {
+    CriticalSectionLock lock;
+    if (poll_outstanding_) { return; }
+    poll_outstanding_ = true;
+  }
+
+  irq_timestamp_us_ = timestamp_us;
+  irq_tag_ = rx_tag_;
+
+  // R_RX_PL_WID returns the STATUS register as well as the width of
+  // the top of the RX FIFO, so one transaction gets us everything we
+  // need to queue the remainder of the sequence.
+  nrf_.IrqCommand(
+      0x60,  // R_RX_PL_WID
+      {},
+      {reinterpret_cast<char*>(&irq_payload_width_), 1},
+      [this](uint8_t status) {
+        irq_status_ = status;
+
+        if (status & (1 << 4)) {
+          // Retransmit count exceeded!  Note what was still queued, so
+          // that HandleEvent can tell how many were sent before the
+          // failure, then flush our TX FIFO.  The flush must land
+          // before MAX_RT is cleared, or the device would try again.
+          nrf_.IrqCommand(
+              0x17,  // R_REGISTER FIFO_STATUS
+              {},
+              {reinterpret_cast<char*>(&irq_fifo_status_), 1},
+              [this, status](uint8_t) {
+                nrf_.IrqCommand(0xe1, {}, {}, {});  // FLUSH_TX
+                ContinueRxDrain(status);
+              });
+          return;
+        }
 
-    const uint8_t maybe_to_clear = status & 0x70;
-    if (maybe_to_clear) {
-      // Yes!
-      nrf_.WriteRegister(0x07, maybe_to_clear);
+        irq_fifo_status_ = 0;
+        ContinueRxDrain(status);
+      });
+}
+
+void Nrf24l01::ContinueRxDrain(uint8_t status) {
+  // RX_P_NO reads as 7 when the RX FIFO is empty.
+  const uint8_t pipe = (status >> 1) & 0x07;
+
+  if (pipe != 0x07) {
+    if (irq_payload_width_ > kMaxPayloadSize) {
+      // The datasheet says the payload must be flushed in this case.
+      nrf_.IrqCommand(0xe2, {}, {}, {});  // FLUSH_RX
+    } else if (rx_queue_full()) {
+      // Leave it in the hardware FIFO until Read makes some room.
+      stats_.rx_overflow++;
+    } else {
+      auto& packet = rx_queue_[rx_written_ % rx_queue_depth_];
+      packet.size = irq_payload_width_;
+      packet.pipe = pipe;
+      packet.channel = channel_;
+      packet.timestamp_us = irq_timestamp_us_;
+      packet.tag = irq_tag_;
+
+      nrf_.IrqCommand(
+          0x61,  // R_RX_PAYLOAD
+          {},
+          {&packet.data[0], static_cast<ssize_t>(irq_payload_width_)},
+          [this](uint8_t) {
+            rx_written_ = rx_written_ + 1;
+            stats_.rx_packets++;
+            stats_.rx_high_water = std::max<uint32_t>(
+                stats_.rx_high_water, rx_written_ - rx_read_);
+
+            // Up to 3 packets can be waiting, so check for another.
+            nrf_.IrqCommand(
+                0x60,  // R_RX_PL_WID
+                {},
+                {reinterpret_cast<char*>(&irq_payload_width_), 1},
+                [this](uint8_t status) {
+                  ContinueRxDrain(status);
+                });
+          });
+      return;
     }
   }
+
+  FinishIrqSequence();
+}
+
+void Nrf24l01::FinishIrqSequence() {
+  const uint8_t status = irq_status_;
+  const uint8_t maybe_to_clear = status & 0x70;
+  nrf_.IrqCommand(
+      0x20 | 0x07,  // W_REGISTER STATUS
+      {reinterpret_cast<const char*>(&maybe_to_clear), 1},
+      {},
+      [this, status](uint8_t final_status) {
+        if (status & 0x70) {
+          const uint8_t fifo_status = irq_fifo_status_;
+          const uint32_t timestamp_us = irq_timestamp_us_;
+          event_queue_.Queue([this, status, fifo_status, timestamp_us]() {
+              this->HandleEvent(status, fifo_status, timestamp_us);
+            });
+        }
+
+        // A packet which arrived after our last check had its RX_DR
+        // cleared by us, so it will not raise an interrupt.
+        rx_fifo_pending_ = ((final_status >> 1) & 0x07) != 0x07;
+        poll_outstanding_ = false;
+
+        // If the line is still low, something new arrived while we
+        // were working.
+        if (irq_.read() == 0 || (rx_fifo_pending_ && !rx_queue_full())) {
+          StartIrqSequence(timer_->read_us());
+        }
+      });
+}
+
+void Nrf24l01::HandleEvent(uint8_t status, uint8_t fifo_status,
+                           uint32_t timestamp_us) {
+  stats_.irq_count++;
+  stats_.irq_latency_us = timer_->read_us() - timestamp_us;
+  stats_.max_irq_latency_us =
+      std::max(stats_.max_irq_latency_us, stats_.irq_latency_us);
+
+  if (status & (1 << 4)) {
+    stats_.retransmit_exceeded++;
+  }
+
+  if (tx_loaded_ == tx_done_) { return; }
+
+  // Streaming transmit bookkeeping.  TX_DS and MAX_RT can both be
+  // set if we were slow to service the interrupt, in which case the
+  // successes came first.
+  if (status & (1 << 5)) {
+    // Several TX_DS can be merged into one interrupt too.  Whatever
+    // we loaded which is no longer in the FIFO has been sent.  After
+    // a MAX_RT, the interrupt sequence read the FIFO before flushing
+    // it, and the failed packet is still counted as queued.
+    const uint8_t fifo = (status & (1 << 4)) ?
+        fifo_status : ReadRegister(0x17);  // FIFO_STATUS
+    const uint32_t loaded = tx_loaded_ - tx_done_;
+    const uint32_t sent =
+        loaded - std::min<uint32_t>(TxFifoDepth(fifo), loaded - 1);
+    for (uint32_t i = 0; i < sent; i++) { CompleteTransmit(true); }
+  }
+
+  if ((status & (1 << 4)) && tx_loaded_ != tx_done_) {
+    // The interrupt sequence has already flushed the TX FIFO, so the
+    // failed packet is gone, as are any behind it.  They will be
+    // loaded again by the refill.
+    CompleteTransmit(false);
+    tx_loaded_ = tx_done_;
+  }
+
+  RefillTxFifo();
+}
+
+void Nrf24l01::CompleteTransmit(bool success) {
+  auto& result = tx_results_[tx_done_ % kMaxTxQueueDepth];
+  result.id = tx_done_;
+  result.success = success;
+  tx_done_++;
+
+  if (success) {
+    stats_.tx_packets++;
+  } else {
+    stats_.tx_failed++;
+  }
+}
+
+void Nrf24l01::RefillTxFifo() {
+  if (!ready()) { return; }
+
+  while (tx_loaded_ != tx_written_ && (tx_loaded_ - tx_done_) < 3) {
+    const auto& packet = tx_queue_[tx_loaded_ % kMaxTxQueueDepth];
+    nrf_.AsyncCommand(0xa0,  // W_TX_PAYLOAD
+                      {&packet.data[0], packet.size}, {}, {});
+    tx_loaded_++;
+  }
+
+  // CE stays high for as long as we have anything outstanding.  The
+  // device sits in standby-II if the FIFO runs dry in the meantime.
+  ce_.write(tx_loaded_ != tx_done_ ? 1 : 0);
 }
 
 void Nrf24l01::PollMillisecond() {
@@ -155,12 +384,38 @@ void Nrf24l01::PollMillisecond() {
 
       Configure();
       configure_state_ = kStandby;
+      if (options_.ptx) { RefillTxFifo(); }
       return;
     }
     case kStandby: {
       break;
     }
   }
+
+  if (options_.verify_registers) {
+    PollVerify();
+  }
+}
+
+void Nrf24l01::PollVerify() {
+  // Check one register each time we are called.
+  for (int i = 0; i < kNumRegisters; i++) {
+    const uint8_t address = verify_address_;
+    verify_address_ = (verify_address_ + 1) % kNumRegisters;
+
+    const auto& shadow = shadow_[address];
+    if (shadow.size == 0 || IsHopRegister(address)) { continue; }
+
+    char buf[5] = {};
+    nrf_.ReadRegister(address, {buf, shadow.size});
+    if (std::string_view(buf, shadow.size) !=
+        std::string_view(shadow.data, shadow.size)) {
+      stats_.verify_failures++;
+      if (error_ == 0) { error_ = 0x100 | address; }
+      nrf_.WriteRegister(address, {shadow.data, shadow.size});
+    }
+    return;
+  }
 }
 
 bool Nrf24l01::ready() const {
@@ -175,64 +430,89 @@ void Nrf24l01::SelectRfChannel(uint8_t channel) {
     // channels without doing this.
     ce_.write(0);
   }
-  VerifyRegister(0x05, channel & 0x7f);  // RF_CH
+  const uint32_t start_us = timer_->read_us();
+  WriteRegisterCached(0x05, channel & 0x7f);  // RF_CH
+  const uint32_t end_us = timer_->read_us();
+  channel_ = channel;
   if (options_.ptx == 0) {
     ce_.write(1);
   }
+
+  stats_.hop_count++;
+  stats_.hop_latency_us = end_us - start_us;
+  stats_.max_hop_latency_us =
+      std::max(stats_.max_hop_latency_us, stats_.hop_latency_us);
 }
 
 bool Nrf24l01::is_data_ready() {
-  return is_data_ready_;
+  return rx_read_ != rx_written_;
+}
+
+bool Nrf24l01::rx_queue_full() const {
+  return (rx_written_ - rx_read_) >= rx_queue_depth_;
 }
 
 bool Nrf24l01::Read(Packet* packet)  {
-  if (!is_data_ready_) {
+  if (!is_data_ready()) {
     packet->size = 0;
     return false;
   }
-  *packet = rx_packet_;
-  rx_packet_.size = 0;
-
-  // Check to see if there is more remaining.
-  const auto status_reg = nrf_.Command(0xff, {}, {});
-  is_data_ready_ = ((status_reg >> 1) & 0x07) != 0x07;
-  if (is_data_ready_) {
-    ReadPacket();
-  }
+  *packet = rx_queue_[rx_read_ % rx_queue_depth_];
+  rx_read_ = rx_read_ + 1;
 
   return true;
 }
 
+bool Nrf24l01::received_power_detected() {
+  char rpd = 0;
+  nrf_.ReadRegister(0x09, {&rpd, 1});  // RPD
+  return (rpd & 0x01) != 0;
+}
+
 void Nrf24l01::Transmit(const Packet* packet) {
   MJ_ASSERT(options_.ptx == 1);
-  nrf_.Command(0xa0, {&packet->data[0], packet->size}, {});
-  // Strobe CE to start this transmit.
-  ce_.write(1);
-  timer_->wait_us(10);
-  ce_.write(0);
+  MJ_ASSERT(packet->size <= kMaxPayloadSize);
+  // Strobe CE to start this transmit once the payload is in the
+  // FIFO.  The 10us pulse is timed in hardware, so we can return
+  // right away.
+  nrf_.AsyncCommand(0xa0,  // W_TX_PAYLOAD
+                    {&packet->data[0], packet->size}, {},
+                    [this](uint8_t) { ce_.Pulse(); });
+}
+
+bool Nrf24l01::QueueTransmit(const Packet* packet, uint32_t* id) {
+  MJ_ASSERT(options_.ptx == 1);
+  MJ_ASSERT(packet->size <= kMaxPayloadSize);
+
+  if ((tx_written_ - tx_result_read_) >= kMaxTxQueueDepth) {
+    return false;
+  }
+
+  tx_queue_[tx_written_ % kMaxTxQueueDepth] = *packet;
+  if (id) { *id = tx_written_; }
+  tx_written_++;
+
+  RefillTxFifo();
+
+  return true;
+}
+
+bool Nrf24l01::ReadTxResult(TxResult* result) {
+  if (tx_result_read_ == tx_done_) { return false; }
+
+  *result = tx_results_[tx_result_read_ % kMaxTxQueueDepth];
+  tx_result_read_++;
+  return true;
 }
 
 void Nrf24l01::QueueAck(const Packet* packet) {
+  MJ_ASSERT(packet->size <= kMaxPayloadSize);
   // We always use PPP == 0
   nrf_.Command(0xa8, {&packet->data[0], packet->size}, {});
 }
 
-void Nrf24l01::ReadPacket() {
-  uint8_t payload_width = 0;
-  nrf_.Command(0x60,  // R_RX_PL_WID
-               {},
-               {reinterpret_cast<char*>(&payload_width), 1});
-  if (payload_width > 16) {
-    return;
-  }
-  rx_packet_.size = payload_width;
-  if (payload_width) {
-    nrf_.Command(0x61, {}, {&rx_packet_.data[0],
-            static_cast<ssize_t>(payload_width)});
-  }
-}
-
 void Nrf24l01::VerifyRegister(uint8_t address, std::string_view data) {
+  UpdateShadow(address, data);
   if (!nrf_.VerifyRegister(address, data) && error_ == 0) {
     // Just report the first error.
     error_ = 0x100 | address;
@@ -240,9 +520,33 @@ void Nrf24l01::VerifyRegister(uint8_t address, std::string_view data) {
 }
 
 void Nrf24l01::VerifyRegister(uint8_t address, uint8_t value) {
-  if (!nrf_.VerifyRegister(address, value) && error_ == 0) {
-    error_ = 0x100 | address;
+  VerifyRegister(address, {reinterpret_cast<const char*>(&value), 1});
+}
+
+void Nrf24l01::WriteRegisterCached(uint8_t address, std::string_view data) {
+  const auto& shadow = shadow_[address];
+  if (shadow.size == data.size() &&
+      std::string_view(shadow.data, shadow.size) == data) {
+    stats_.writes_elided++;
+    return;
+  }
+
+  UpdateShadow(address, data);
+  nrf_.WriteRegister(address, data);
+}
+
+void Nrf24l01::WriteRegisterCached(uint8_t address, uint8_t value) {
+  WriteRegisterCached(address, {reinterpret_cast<const char*>(&value), 1});
+}
+
+void Nrf24l01::UpdateShadow(uint8_t address, std::string_view data) {
+  if (address >= kNumRegisters || IsVolatileRegister(address) ||
+      data.size() > sizeof(ShadowRegister::data)) {
+    return;
   }
+  auto& shadow = shadow_[address];
+  shadow.size = data.size();
+  std::memcpy(shadow.data, data.data(), data.size());
 }
 
 void Nrf24l01::WriteConfig() {
@@ -331,8 +635,8 @@ void Nrf24l01::SelectId(uint64_t id) {
   std::string_view id_view{
     reinterpret_cast<const char*>(&id_buf[0]),
         static_cast<size_t>(options_.address_length)};
-  VerifyRegister(0x0a,  id_view); // RX_ADDR_P0
-  VerifyRegister(0x10,  id_view); // TX_ADDR
+  WriteRegisterCached(0x0a,  id_view); // RX_ADDR_P0
+  WriteRegisterCached(0x10,  id_view); // TX_ADDR
 }
 
 uint8_t Nrf24l01::GetConfig() const {
@@ -347,10 +651,15 @@ uint8_t Nrf24l01::GetConfig() const {
       ;
 }
 
+Nrf24l01::Stats Nrf24l01::stats() const {
+  CriticalSectionLock lock;
+  return stats_;
+}
+
 Nrf24l01::Status Nrf24l01::status() {
   Status result;
   result.status_reg = nrf_.Command(0xff, {}, {});
-  result.retransmit_exceeded = retransmit_exceeded_;
+  result.retransmit_exceeded = stats_.retransmit_exceeded;
   return result;
 }
 
@@ -363,6 +672,9 @@ void Nrf24l01::ReadRegister(uint8_t reg, mjlib::base::string_span buffer) {
 }
 
 void Nrf24l01::WriteRegister(uint8_t reg, std::string_view buffer) {
+  // Keep the shadow in sync so the background verification does not
+  // undo this.
+  UpdateShadow(reg, buffer);
   nrf_.WriteRegister(reg, buffer);
 }
 
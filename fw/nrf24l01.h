@@ -19,14 +19,41 @@
 #include "PinNames.h"
 
 #include "mjlib/base/string_span.h"
+#include "mjlib/base/visitor.h"
+#include "mjlib/micro/atomic_event_queue.h"
 #include "mjlib/micro/pool_ptr.h"
 
 #include "fw/millisecond_timer.h"
+#include "fw/stm32g4_dma_spi.h"
+#include "fw/stm32g4_pulse_output.h"
 
 namespace fw {
 
+/// Drives an nRF24L01+ over SPI1 using DMA.
+///
+/// Threading model:
+///  * Poll, PollMillisecond, Read, QueueTransmit, ReadTxResult,
+///    QueueAck, and the register accessors must only be called from
+///    the main loop.  PollMillisecond performs blocking SPI
+///    transactions for configuration and register verification.
+///  * SelectRfChannel, SelectId, SetRxTag, received_power_detected,
+///    and Transmit may additionally be called from one interrupt, as long
+///    as it is preempted by the SPI DMA interrupt, and only once
+///    ready() is true.  They may block on SPI transactions.  The
+///    registers they write are owned by that caller and are not
+///    checked by the background verification.
+///  * The IRQ line is serviced from the EXTI and DMA interrupts,
+///    which never wait.  Received packets are handed to Read through
+///    a single producer, single consumer queue.
+///  * Each Stats field is only written from one context.  stats()
+///    takes a consistent copy with interrupts disabled.
 class Nrf24l01 {
  public:
+  /// The largest dynamic payload the device supports.
+  static constexpr int kMaxPayloadSize = 32;
+  static constexpr int kMaxRxQueueDepth = 16;
+  static constexpr int kMaxTxQueueDepth = 8;
+
   struct Pins {
     ////////////////////
     // Pin configuration
@@ -61,6 +88,15 @@ class Nrf24l01 {
     // Can be one of -18, -12, -6, 0.
     int output_power = 0;
 
+    /// The number of received packets which can be buffered in
+    /// software, up to kMaxRxQueueDepth.
+    int rx_queue_depth = 8;
+
+    /// If true, one configuration register is read back each
+    /// millisecond and compared against the shadow copy.  Mismatches
+    /// are rewritten and reported through error().
+    bool verify_registers = true;
+
     Options() {}
   };
 
@@ -80,6 +116,12 @@ class Nrf24l01 {
   /// Switch to a different shockburst ID.
   void SelectId(uint64_t id);
 
+  /// Set the value reported in Packet::tag for packets whose IRQ is
+  /// asserted from now on.  This lets the caller tell which of its
+  /// transmissions an acknowledgement payload belongs to, even if it
+  /// has moved on by the time the packet is read.
+  void SetRxTag(uint8_t tag) { rx_tag_ = tag; }
+
   /// Return true if there is data available to read.
   bool is_data_ready();
 
@@ -89,18 +131,112 @@ class Nrf24l01 {
   };
   Status status();
 
+  struct Stats {
+    uint32_t rx_packets = 0;
+
+    /// The number of times a packet had to be left in the hardware
+    /// FIFO because the receive queue was full.
+    uint32_t rx_overflow = 0;
+
+    /// The largest number of packets that have been queued at once.
+    uint32_t rx_high_water = 0;
+
+    uint32_t retransmit_exceeded = 0;
+
+    /// Packets sent with QueueTransmit which completed, or which were
+    /// dropped after exceeding the retransmit count.
+    uint32_t tx_packets = 0;
+    uint32_t tx_failed = 0;
+
+    /// Channel changes, and how long the SPI traffic for each took.
+    uint32_t hop_count = 0;
+    uint32_t hop_latency_us = 0;
+    uint32_t max_hop_latency_us = 0;
+
+    /// Register writes skipped because the shadow copy showed the
+    /// device already had that value.
+    uint32_t writes_elided = 0;
+
+    /// Registers found to differ from the shadow copy by the
+    /// background verification.
+    uint32_t verify_failures = 0;
+
+    /// The number of IRQ events processed, and the time between the
+    /// falling edge of the IRQ line and when the event was consumed
+    /// by Poll.
+    uint32_t irq_count = 0;
+    uint32_t irq_latency_us = 0;
+    uint32_t max_irq_latency_us = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(rx_packets));
+      a->Visit(MJ_NVP(rx_overflow));
+      a->Visit(MJ_NVP(rx_high_water));
+      a->Visit(MJ_NVP(retransmit_exceeded));
+      a->Visit(MJ_NVP(tx_packets));
+      a->Visit(MJ_NVP(tx_failed));
+      a->Visit(MJ_NVP(hop_count));
+      a->Visit(MJ_NVP(hop_latency_us));
+      a->Visit(MJ_NVP(max_hop_latency_us));
+      a->Visit(MJ_NVP(writes_elided));
+      a->Visit(MJ_NVP(verify_failures));
+      a->Visit(MJ_NVP(irq_count));
+      a->Visit(MJ_NVP(irq_latency_us));
+      a->Visit(MJ_NVP(max_irq_latency_us));
+    }
+  };
+  Stats stats() const;
+
   struct Packet {
     size_t size = 0;
-    char data[32] = {};
+    char data[kMaxPayloadSize] = {};
+
+    // The following are only filled in for received packets.
+    uint8_t pipe = 0;
+    uint8_t channel = 0;
+    /// The time the IRQ line was asserted, as reported by
+    /// MillisecondTimer::read_us.
+    uint32_t timestamp_us = 0;
+    /// The value of SetRxTag when the IRQ line was asserted.
+    uint8_t tag = 0;
   };
 
   /// Read the next available data packet.  @return false if no data
   /// was available.
   bool Read(Packet*);
 
-  /// Transmit a packet.
+  /// Return true if the RPD register reports a carrier above -64dBm
+  /// on the current channel.  This needs the receiver to have been
+  /// active on the channel for at least 170us.
+  bool received_power_detected();
+
+  /// Transmit a packet immediately with a single CE pulse.  This
+  /// returns before the payload has been written or the pulse sent.
   void Transmit(const Packet*);
 
+  /// Queue a packet for streaming transmission.  Queued packets are
+  /// kept loaded into the 3 deep TX FIFO with CE held high, so that
+  /// back to back packets are sent without returning to standby.
+  /// The FIFO is refilled as each TX_DS interrupt is processed.  This
+  /// can only be called if Options::ptx == true.
+  ///
+  /// @return false if the queue is full, which includes completed
+  /// packets whose results have not yet been read.
+  bool QueueTransmit(const Packet*, uint32_t* id = nullptr);
+
+  struct TxResult {
+    /// The id reported by QueueTransmit.
+    uint32_t id = 0;
+
+    /// false if the retransmit count was exceeded.
+    bool success = false;
+  };
+
+  /// Read the result of the oldest completed QueueTransmit packet.
+  /// @return false if none are available.
+  bool ReadTxResult(TxResult*);
+
   /// Queue the given packet to be sent as the next auto
   /// acknowledgement.  This can only be called if Options::ptx == false
   void QueueAck(const Packet*);
@@ -113,9 +249,21 @@ class Nrf24l01 {
   uint32_t error() const { return error_; }
 
  private:
-  void ReadPacket();
+  void HandleIrq();
+  void StartIrqSequence(uint32_t timestamp_us);
+  void ContinueRxDrain(uint8_t status);
+  void FinishIrqSequence();
+  void HandleEvent(uint8_t status, uint8_t fifo_status,
+                   uint32_t timestamp_us);
+  bool rx_queue_full() const;
+  void CompleteTransmit(bool success);
+  void RefillTxFifo();
   void VerifyRegister(uint8_t address, std::string_view);
   void VerifyRegister(uint8_t address, uint8_t value);
+  void WriteRegisterCached(uint8_t address, std::string_view);
+  void WriteRegisterCached(uint8_t address, uint8_t value);
+  void UpdateShadow(uint8_t address, std::string_view);
+  void PollVerify();
 
   void WriteConfig();
   void Configure();
@@ -128,10 +276,30 @@ class Nrf24l01 {
 
   class SpiMaster {
    public:
-    SpiMaster(SPI*, PinName cs, MillisecondTimer*);
+    SpiMaster(PinName cs, MillisecondTimer*);
+
+    /// Run the given command, blocking until it is complete.
     uint8_t Command(uint8_t command,
                     std::string_view,
                     mjlib::base::string_span);
+
+    /// Queue the given command to be run after any outstanding ones.
+    /// The callback is invoked from interrupt context with the
+    /// STATUS register.
+    void AsyncCommand(uint8_t command,
+                      std::string_view,
+                      mjlib::base::string_span,
+                      const Stm32G4DmaSpi::Callback&);
+
+    /// Like AsyncCommand, but for the IRQ sequence, which runs from
+    /// interrupt context and so must never wait.  It uses
+    /// the DMA queue's reserved entries, and never has more than
+    /// Stm32G4DmaSpi::kReservedSize outstanding.
+    void IrqCommand(uint8_t command,
+                    std::string_view,
+                    mjlib::base::string_span,
+                    const Stm32G4DmaSpi::Callback&);
+
     uint8_t WriteRegister(uint8_t address, std::string_view);
     uint8_t WriteRegister(uint8_t address, uint8_t data);
 
@@ -141,30 +309,79 @@ class Nrf24l01 {
     bool VerifyRegister(uint8_t address, uint8_t value);
 
    private:
-    SPI* const spi_;
-    DigitalOut cs_;
+    Stm32G4DmaSpi dma_;
     MillisecondTimer* const timer_;
     char buf_[16] = {};
   };
 
   SpiMaster nrf_;
 
-  DigitalIn irq_;
-  DigitalOut ce_;
+  InterruptIn irq_;
+  Stm32G4PulseOutput ce_;
+
+  // Events are queued from the DMA completion interrupt once the
+  // interrupt sequence has finished, and consumed in Poll.
+  mjlib::micro::AtomicEventQueue<8> event_queue_;
 
   enum ConfigureState {
     kPowerOnReset,
     kEnteringStandby,
     kStandby,
   };
-  ConfigureState configure_state_ = kPowerOnReset;
+  // Written from PollMillisecond and read through ready() from the
+  // interrupt which hops channels.
+  volatile ConfigureState configure_state_ = kPowerOnReset;
   uint32_t start_entering_standby_ = 0;
 
-  bool is_data_ready_ = false;
-  bool rx_overflow_ = false;
+  uint8_t channel_ = 0;
 
-  uint32_t retransmit_exceeded_ = 0;
-  Packet rx_packet_;
+  // Written by SetRxTag, possibly from an interrupt, and latched at
+  // the start of each IRQ sequence.
+  volatile uint8_t rx_tag_ = 0;
+
+  // A copy of what we believe the configuration registers on the
+  // device contain.  A size of 0 means the register is unknown or is
+  // not a configuration register.
+  static constexpr int kNumRegisters = 0x1e;
+  struct ShadowRegister {
+    uint8_t size = 0;
+    char data[5] = {};
+  };
+  ShadowRegister shadow_[kNumRegisters] = {};
+  uint8_t verify_address_ = 0;
+
+  // These are updated from the DMA completion interrupt.
+  volatile bool poll_outstanding_ = false;
+  volatile bool rx_fifo_pending_ = false;
+  uint32_t irq_timestamp_us_ = 0;
+  uint8_t irq_tag_ = 0;
+  uint8_t irq_status_ = 0;
+  // FIFO_STATUS from before the TX FIFO was flushed, only read when
+  // the retransmit count was exceeded.
+  uint8_t irq_fifo_status_ = 0;
+  uint8_t irq_payload_width_ = 0;
+
+  // The receive queue is written from the DMA completion interrupt
+  // and read from Read.  Each counter is only ever advanced by one
+  // side.
+  const uint32_t rx_queue_depth_;
+  Packet rx_queue_[kMaxRxQueueDepth] = {};
+  volatile uint32_t rx_written_ = 0;
+  volatile uint32_t rx_read_ = 0;
+
+  // The streaming transmit queue is only touched from the main
+  // loop.  Entries between tx_done_ and tx_loaded_ are in the
+  // hardware FIFO, those between tx_loaded_ and tx_written_ are
+  // waiting for room, and results are available between
+  // tx_result_read_ and tx_done_.
+  Packet tx_queue_[kMaxTxQueueDepth] = {};
+  TxResult tx_results_[kMaxTxQueueDepth] = {};
+  uint32_t tx_written_ = 0;
+  uint32_t tx_loaded_ = 0;
+  uint32_t tx_done_ = 0;
+  uint32_t tx_result_read_ = 0;
+
+  Stats stats_;
 
   uint32_t error_ = 0;
 
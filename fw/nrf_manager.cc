@@ -41,6 +41,9 @@ struct Config {
   int32_t initial_channel = 2;
   int32_t data_rate = 1000000;
   int32_t output_power = 0;
+  int32_t rx_queue_depth = 8;
+  bool verify_registers = true;
+  bool print_timestamps = false;
 
   template <typename Archive>
   void Serialize(Archive* a) {
@@ -56,6 +59,9 @@ struct Config {
     a->Visit(MJ_NVP(initial_channel));
     a->Visit(MJ_NVP(data_rate));
     a->Visit(MJ_NVP(output_power));
+    a->Visit(MJ_NVP(rx_queue_depth));
+    a->Visit(MJ_NVP(verify_registers));
+    a->Visit(MJ_NVP(print_timestamps));
   }
 };
 
@@ -79,12 +85,14 @@ class NrfManager::Impl {
  public:
   Impl(mjlib::micro::PersistentConfig& persistent_config,
        mjlib::micro::CommandManager& command_manager,
+       mjlib::micro::TelemetryManager& telemetry_manager,
        mjlib::micro::AsyncExclusive<mjlib::micro::AsyncWriteStream>& stream,
        fw::MillisecondTimer* timer,
        const Options& options)
       : options_(options),
         timer_(timer),
         stream_(stream) {
+    nrf_stats_updater_ = telemetry_manager.Register("nrf", &nrf_stats_);
     persistent_config.Register(
         "nrf", &config_, [this]() { this->UpdateConfig(); });
     command_manager.Register(
@@ -105,7 +113,14 @@ class NrfManager::Impl {
     MJ_ASSERT(!!nrf_);
     nrf_->Poll();
 
-    if (nrf_->is_data_ready()) {
+    // Packets and transmit results stay queued in the driver while a
+    // previous line is being emitted.
+    if (write_outstanding_) { return; }
+
+    Nrf24l01::TxResult tx_result;
+    if (nrf_->ReadTxResult(&tx_result)) {
+      EmitTxResult(tx_result);
+    } else if (nrf_->is_data_ready()) {
       ReadData();
     }
   }
@@ -113,6 +128,9 @@ class NrfManager::Impl {
   void PollMillisecond() {
     MJ_ASSERT(!!nrf_);
     nrf_->PollMillisecond();
+
+    nrf_stats_ = nrf_->stats();
+    nrf_stats_updater_();
   }
 
  private:
@@ -135,6 +153,8 @@ class NrfManager::Impl {
           options.initial_channel = config_.initial_channel;
           options.data_rate = config_.data_rate;
           options.output_power = config_.output_power;
+          options.rx_queue_depth = config_.rx_queue_depth;
+          options.verify_registers = config_.verify_registers;
 
           return options;
         }());
@@ -144,9 +164,6 @@ class NrfManager::Impl {
     Nrf24l01::Packet packet;
     nrf_->Read(&packet);
 
-    if (write_outstanding_) { return; }
-
-    write_outstanding_ = true;
     size_t pos = 0;
     auto fmt = [&](auto ...args) {
       pos += snprintf(&emit_line_[pos], sizeof(emit_line_) - pos, args...);
@@ -154,10 +171,27 @@ class NrfManager::Impl {
 
     fmt("rcv ");
     for (size_t i = 0; i < packet.size; i++) {
-      fmt("%02X", packet.data[i]);
+      fmt("%02X", static_cast<uint8_t>(packet.data[i]));
+    }
+    if (config_.print_timestamps) {
+      // When the IRQ fired for this packet, and how long ago that was
+      // as we hand it to the host.
+      fmt(" T%" PRIu32 " A%" PRIu32,
+          packet.timestamp_us, timer_->read_us() - packet.timestamp_us);
     }
     fmt("\r\n");
 
+    EmitLine();
+  }
+
+  void EmitTxResult(const Nrf24l01::TxResult& result) {
+    snprintf(emit_line_, sizeof(emit_line_), "txd %" PRIu32 " %s\r\n",
+             result.id, result.success ? "OK" : "FAIL");
+    EmitLine();
+  }
+
+  void EmitLine() {
+    write_outstanding_ = true;
     stream_.AsyncStart(
         [this](micro::AsyncWriteStream* write_stream,
                micro::VoidCallback done_callback) {
@@ -178,6 +212,8 @@ class NrfManager::Impl {
     auto cmd = tokenizer.next();
     if (cmd == "tx") {
       Command_Tx(tokenizer.remaining(), response);
+    } else if (cmd == "txs") {
+      Command_TxStream(tokenizer.remaining(), response);
     } else if (cmd == "ack") {
       Command_Ack(tokenizer.remaining(), response);
     } else if (cmd == "chan") {
@@ -212,6 +248,22 @@ class NrfManager::Impl {
     WriteOK(response);
   }
 
+  void Command_TxStream(std::string_view hexdata,
+                        const micro::CommandManager::Response& response) {
+    Nrf24l01::Packet packet;
+    if (!ParsePacket(hexdata, &packet, response)) { return; }
+
+    uint32_t id = 0;
+    if (!nrf_->QueueTransmit(&packet, &id)) {
+      WriteMessage("ERR queue full\r\n", response);
+      return;
+    }
+
+    snprintf(response_line_, sizeof(response_line_),
+             "OK %" PRIu32 "\r\n", id);
+    WriteMessage(response_line_, response);
+  }
+
   void Command_Ack(std::string_view hexdata,
                    const micro::CommandManager::Response& response) {
     Nrf24l01::Packet packet;
@@ -234,9 +286,10 @@ class NrfManager::Impl {
 
   void Command_Stat(const micro::CommandManager::Response& response) {
     const auto status = nrf_->status();
-    snprintf(emit_line_, sizeof(emit_line_), "OK s=%02X r=%" PRIu32 "\r\n",
+    snprintf(response_line_, sizeof(response_line_),
+             "OK s=%02X r=%" PRIu32 "\r\n",
              status.status_reg, status.retransmit_exceeded);
-    WriteMessage(emit_line_, response);
+    WriteMessage(response_line_, response);
   }
 
   void Command_Read(std::string_view remaining,
@@ -256,18 +309,19 @@ class NrfManager::Impl {
 
     ssize_t pos = 0;
     auto fmt = [&](auto ...args) {
-      pos += snprintf(&emit_line_[pos], sizeof(emit_line_) - pos, args...);
+      pos += snprintf(&response_line_[pos], sizeof(response_line_) - pos,
+                      args...);
     };
 
     fmt("OK ");
 
     for (ssize_t i = 0; i < size; i++) {
-      fmt("%02X", buf[i]);
+      fmt("%02X", static_cast<uint8_t>(buf[i]));
     }
 
     fmt("\r\n");
 
-    WriteMessage(emit_line_, response);
+    WriteMessage(response_line_, response);
   }
 
   void Command_Write(std::string_view remaining,
@@ -303,6 +357,10 @@ class NrfManager::Impl {
       WriteMessage("ERR data invalid length\r\n", response);
       return false;
     }
+    if (hexdata.size() > 2 * Nrf24l01::kMaxPayloadSize) {
+      WriteMessage("ERR data too long\r\n", response);
+      return false;
+    }
 
     size_t bytes = 0;
     for (size_t i = 0; i < hexdata.size(); i += 2) {
@@ -323,20 +381,29 @@ class NrfManager::Impl {
   Config config_;
   std::optional<Nrf24l01> nrf_;
 
+  Nrf24l01::Stats nrf_stats_;
+  micro::StaticFunction<void()> nrf_stats_updater_;
+
   bool write_outstanding_ = false;
   char emit_line_[256] = {};
   micro::VoidCallback done_callback_;
+
+  // Command responses are formatted separately, so they cannot
+  // clobber an asynchronous emission in progress.
+  char response_line_[64] = {};
 };
 
 NrfManager::NrfManager(
     mjlib::micro::Pool& pool,
     mjlib::micro::PersistentConfig& persistent_config,
     mjlib::micro::CommandManager& command_manager,
+    mjlib::micro::TelemetryManager& telemetry_manager,
     mjlib::micro::AsyncExclusive<
     mjlib::micro::AsyncWriteStream>& stream,
     MillisecondTimer* timer,
     const Options& options)
-    : impl_(&pool, persistent_config, command_manager, stream, timer, options) {}
+    : impl_(&pool, persistent_config, command_manager, telemetry_manager,
+            stream, timer, options) {}
 
 NrfManager::~NrfManager() {}
 
@@ -19,6 +19,7 @@
 #include "mjlib/micro/command_manager.h"
 #include "mjlib/micro/persistent_config.h"
 #include "mjlib/micro/pool_ptr.h"
+#include "mjlib/micro/telemetry_manager.h"
 
 #include "fw/millisecond_timer.h"
 #include "fw/nrf24l01.h"
@@ -33,6 +34,7 @@ class NrfManager {
   NrfManager(mjlib::micro::Pool&,
              mjlib::micro::PersistentConfig&,
              mjlib::micro::CommandManager&,
+             mjlib::micro::TelemetryManager&,
              mjlib::micro::AsyncExclusive<
              mjlib::micro::AsyncWriteStream>& stream,
              MillisecondTimer*,
@@ -19,6 +19,7 @@
 #include "mjlib/micro/telemetry_manager.h"
 
 #include "fw/firmware_info.h"
+#include "fw/framed_read_stream.h"
 #include "fw/git_info.h"
 #include "fw/millisecond_timer.h"
 #include "fw/nrf_manager.h"
@@ -45,13 +46,16 @@ int main(void) {
 
   fw::MillisecondTimer timer;
 
-  micro::SizedPool<12288> pool;
+  // This holds every manager, including all the remotes' slot and
+  // bulk state, so it is too large for the stack.
+  static micro::SizedPool<49152> pool;
 
   fw::Stm32G4AsyncUsbCdc usb(&pool, {});
 
   micro::AsyncExclusive<micro::AsyncWriteStream> write_stream(&usb);
+  fw::FramedReadStream host_stream(&usb);
   micro::CommandManager command_manager(
-      &pool, &usb, &write_stream,
+      &pool, &host_stream, &write_stream,
       []() {
         micro::CommandManager::Options options;
         options.max_line_length = 300;
@@ -70,7 +74,7 @@ int main(void) {
   fw::FirmwareInfo firmware_info(pool, telemetry_manager);
 
   Manager manager(
-      pool, persistent_config, command_manager,
+      pool, persistent_config, command_manager, telemetry_manager,
       write_stream, &timer,
       [&]() {
         Manager::Options options;
@@ -83,26 +87,48 @@ int main(void) {
         pins.irq = PA_3;
         pins.ce = PA_8;
 
+#ifndef NRFUSB_RAW
+        options.host_stream = &host_stream;
+#endif
+
         return options;
       }());
 
   fw::GitInfo git_info;
   telemetry_manager.Register("git", &git_info);
 
+  fw::Stm32G4AsyncUsbCdc::Stats usb_stats;
+  auto usb_stats_updater = telemetry_manager.Register("usb", &usb_stats);
+
   persistent_config.Load();
 
   command_manager.AsyncStart();
   manager.Start();
 
   uint32_t old = timer.read_ms();;
+#ifndef NRFUSB_RAW
+  uint32_t old_frame = usb.frame_count();
+#endif
   while (true) {
     const uint32_t now = timer.read_ms();
 
     usb.Poll();
+    host_stream.Poll();
+
+#ifndef NRFUSB_RAW
+    const uint32_t frame = usb.frame_count();
+    if (frame != old_frame) {
+      manager.PollFrame(frame - old_frame);
+      old_frame = frame;
+    }
+#endif
+
     manager.Poll();
 
     if (now != old) {
       manager.PollMillisecond();
+      usb_stats = usb.stats();
+      usb_stats_updater();
       old = now;
     }
   }
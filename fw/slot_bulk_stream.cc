@@ -0,0 +1,265 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/slot_bulk_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mbed.h"
+
+namespace fw {
+
+namespace {
+constexpr uint8_t kSeqMask = 0x7f;
+
+// The top bit of the first byte of data and ack records is the stream
+// epoch.  A sender starts each new stream at sequence number 0, with
+// the opposite epoch to the one its peer last followed.  The peer can
+// then always tell a new stream from the old one, wherever the
+// sequence numbers had gotten to.
+constexpr uint8_t kEpochBit = 0x80;
+
+// How many packets to wait for an acknowledgement before sending a
+// segment again.  Acks come back with the peer's next packet, so
+// this leaves room for one to be lost.
+constexpr uint16_t kRetransmitPackets = 4;
+
+int SeqDistance(uint8_t to, uint8_t from) {
+  return (to - from) & kSeqMask;
+}
+}
+
+int SlotBulkStream::Write(const uint8_t* data, int size) {
+  CriticalSectionLock lock;
+
+  const int count = std::min<int>(size, kBufferSize - tx_count_);
+  for (int i = 0; i < count; i++) {
+    tx_buffer_[(tx_start_ + tx_count_ + i) % kBufferSize] = data[i];
+  }
+  tx_count_ += count;
+  stats_.tx_bytes += count;
+
+  return count;
+}
+
+int SlotBulkStream::Read(uint8_t* data, int size) {
+  CriticalSectionLock lock;
+
+  const int count = std::min<int>(size, rx_count_);
+  for (int i = 0; i < count; i++) {
+    data[i] = rx_buffer_[(rx_start_ + i) % kBufferSize];
+  }
+  rx_start_ = (rx_start_ + count) % kBufferSize;
+  rx_count_ -= count;
+  stats_.rx_bytes += count;
+
+  // Segments may have been waiting for the space.
+  Deliver();
+
+  return count;
+}
+
+int SlotBulkStream::write_available() const {
+  return kBufferSize - tx_count_;
+}
+
+int SlotBulkStream::read_available() const {
+  return rx_count_;
+}
+
+int SlotBulkStream::PrepareAck(uint8_t* record, int max_size) {
+  if (!ack_pending_ || max_size < kAckSize) { return 0; }
+  ack_pending_ = false;
+
+  uint8_t mask = 0;
+  for (int i = 0; i < kWindow - 1; i++) {
+    const uint8_t seq = (rx_next_seq_ + 1 + i) & kSeqMask;
+    if (rx_segments_[seq % kWindow].valid) { mask |= (1 << i); }
+  }
+
+  record[0] = rx_next_seq_ | rx_epoch_;
+  record[1] = mask;
+  return kAckSize;
+}
+
+int SlotBulkStream::PrepareData(uint8_t* record, int max_size) {
+  packet_count_++;
+
+  if (!tx_synced_) {
+    // Until we know which epoch the peer last followed, ask for an
+    // ack with a record holding no data.
+    if (tx_count_ == 0 || max_size < 1) { return 0; }
+    record[0] = 0;
+    return 1;
+  }
+
+  if (max_size < 2) { return 0; }
+
+  const auto emit = [&](uint8_t seq) {
+    auto& segment = segments_[seq % kWindow];
+    segment.sent_packet = packet_count_;
+    stats_.segments_sent++;
+
+    record[0] = seq | tx_epoch_;
+    for (int i = 0; i < segment.size; i++) {
+      record[1 + i] = tx_buffer_[(segment.offset + i) % kBufferSize];
+    }
+    return segment.size + 1;
+  };
+
+  // Anything which has gone unacknowledged for too long goes first,
+  // oldest first.
+  const int outstanding = SeqDistance(next_seq_, base_seq_);
+  for (int i = 0; i < outstanding; i++) {
+    const uint8_t seq = (base_seq_ + i) & kSeqMask;
+    const auto& segment = segments_[seq % kWindow];
+    if (segment.acked) { continue; }
+    if (static_cast<uint16_t>(packet_count_ - segment.sent_packet) <
+        kRetransmitPackets) {
+      continue;
+    }
+    if (segment.size + 1 > max_size) { continue; }
+
+    stats_.retransmits++;
+    return emit(seq);
+  }
+
+  // Otherwise, cut a new segment if the window allows.
+  if (outstanding >= kWindow) { return 0; }
+  const int unsent = tx_count_ - tx_cut_;
+  if (unsent == 0) { return 0; }
+
+  auto& segment = segments_[next_seq_ % kWindow];
+  segment.offset = (tx_start_ + tx_cut_) % kBufferSize;
+  segment.size = std::min<int>({unsent, kMaxSegmentSize, max_size - 1});
+  segment.acked = false;
+  tx_cut_ += segment.size;
+
+  const uint8_t seq = next_seq_;
+  next_seq_ = (next_seq_ + 1) & kSeqMask;
+  return emit(seq);
+}
+
+void SlotBulkStream::HandleData(const uint8_t* record, int size) {
+  if (size < 1 || (size - 1) > kMaxSegmentSize) { return; }
+
+  CriticalSectionLock lock;
+
+  // Whatever happens, let the peer know where we are.
+  ack_pending_ = true;
+
+  if (size == 1) {
+    // The peer is about to start a new stream, with whatever epoch
+    // our ack does not carry.
+    rx_synced_ = true;
+    return;
+  }
+
+  const uint8_t seq = record[0] & kSeqMask;
+  const uint8_t epoch = record[0] & kEpochBit;
+
+  // A new epoch is a new stream, starting from 0.  If we restarted
+  // instead, we just pick up wherever the peer is.
+  if (!rx_synced_ || epoch != rx_epoch_) {
+    for (auto& segment : rx_segments_) { segment = {}; }
+    rx_next_seq_ = rx_synced_ ? 0 : seq;
+    rx_epoch_ = epoch;
+    rx_synced_ = true;
+    stats_.resyncs++;
+  }
+
+  auto& segment = rx_segments_[seq % kWindow];
+  if (SeqDistance(seq, rx_next_seq_) >= kWindow || segment.valid) {
+    stats_.duplicates++;
+    return;
+  }
+
+  segment.valid = true;
+  segment.size = size - 1;
+  std::memcpy(segment.data, &record[1], segment.size);
+
+  Deliver();
+}
+
+void SlotBulkStream::HandleAck(const uint8_t* record, int size) {
+  if (size < kAckSize) { return; }
+
+  CriticalSectionLock lock;
+
+  const uint8_t next = record[0] & kSeqMask;
+  const uint8_t epoch = record[0] & kEpochBit;
+  const uint8_t mask = record[1];
+
+  if (!tx_synced_) {
+    // Start our stream in the epoch the peer is not following.
+    for (auto& segment : segments_) { segment = {}; }
+    tx_cut_ = 0;
+    base_seq_ = 0;
+    next_seq_ = 0;
+    tx_epoch_ = epoch ^ kEpochBit;
+    tx_synced_ = true;
+    return;
+  }
+
+  // Anything else is from before the peer saw our stream.
+  if (epoch != tx_epoch_) { return; }
+
+  const int outstanding = SeqDistance(next_seq_, base_seq_);
+  const int acked_count = SeqDistance(next, base_seq_);
+  if (acked_count > outstanding) { return; }
+
+  for (int i = 0; i < acked_count; i++) {
+    segments_[((base_seq_ + i) & kSeqMask) % kWindow].acked = true;
+  }
+  for (int i = 0; i < kWindow - 1; i++) {
+    const int distance = acked_count + 1 + i;
+    if (distance >= outstanding) { break; }
+    if ((mask & (1 << i)) == 0) { continue; }
+    segments_[((base_seq_ + distance) & kSeqMask) % kWindow].acked = true;
+  }
+
+  // Release everything at the front of the window which is done.
+  while (base_seq_ != next_seq_) {
+    auto& segment = segments_[base_seq_ % kWindow];
+    if (!segment.acked) { break; }
+
+    tx_start_ = (tx_start_ + segment.size) % kBufferSize;
+    tx_count_ -= segment.size;
+    tx_cut_ -= segment.size;
+    stats_.tx_acked_bytes += segment.size;
+
+    segment = {};
+    base_seq_ = (base_seq_ + 1) & kSeqMask;
+  }
+}
+
+void SlotBulkStream::Deliver() {
+  while (true) {
+    auto& segment = rx_segments_[rx_next_seq_ % kWindow];
+    if (!segment.valid || segment.size > (kBufferSize - rx_count_)) {
+      return;
+    }
+
+    for (int i = 0; i < segment.size; i++) {
+      rx_buffer_[(rx_start_ + rx_count_ + i) % kBufferSize] = segment.data[i];
+    }
+    rx_count_ += segment.size;
+
+    segment.valid = false;
+    rx_next_seq_ = (rx_next_seq_ + 1) & kSeqMask;
+  }
+}
+
+}
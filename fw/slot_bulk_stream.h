@@ -0,0 +1,154 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// A reliable byte stream in each direction between two peers, which
+/// is carried in extended records using whatever space the slots
+/// leave in each packet.
+///
+/// Data is cut into segments with a 7 bit sequence number, and up to
+/// kWindow segments may be outstanding.  The peer replies with the
+/// next sequence number it expects and a bitmask of the segments
+/// after that which it already holds, so only the missing ones are
+/// sent again.
+///
+/// The Prepare methods are called from the scheduler interrupt,
+/// everything else from the main loop.
+class SlotBulkStream {
+ public:
+  static constexpr int kWindow = 8;
+
+  /// A data record holds the sequence number and the segment.
+  static constexpr int kMaxSegmentSize = 13;
+
+  /// Each direction buffers one window of full segments.  There is
+  /// one stream per remote, so this is kept no larger than the window
+  /// can use.
+  static constexpr int kBufferSize = kWindow * kMaxSegmentSize;
+  static constexpr int kMaxDataSize = kMaxSegmentSize + 1;
+  /// An ack record holds the next expected sequence number and the
+  /// selective ack bitmask.
+  static constexpr int kAckSize = 2;
+
+  struct Stats {
+    /// Bytes accepted from the host, and how many of those the peer
+    /// has acknowledged.
+    uint32_t tx_bytes = 0;
+    uint32_t tx_acked_bytes = 0;
+    /// Bytes delivered in order to the host.
+    uint32_t rx_bytes = 0;
+
+    uint32_t segments_sent = 0;
+    uint32_t retransmits = 0;
+    /// Segments received which we already had.
+    uint32_t duplicates = 0;
+    /// The number of times the receive side started following a new
+    /// stream from the peer, for instance after either restarted.
+    uint32_t resyncs = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(tx_bytes));
+      a->Visit(MJ_NVP(tx_acked_bytes));
+      a->Visit(MJ_NVP(rx_bytes));
+      a->Visit(MJ_NVP(segments_sent));
+      a->Visit(MJ_NVP(retransmits));
+      a->Visit(MJ_NVP(duplicates));
+      a->Visit(MJ_NVP(resyncs));
+    }
+  };
+
+  /// Queue up to @p size bytes for the peer, and return how many were
+  /// accepted.
+  int Write(const uint8_t* data, int size);
+
+  /// Copy up to @p size received bytes into @p data, and return how
+  /// many there were.
+  int Read(uint8_t* data, int size);
+
+  int write_available() const;
+  int read_available() const;
+
+  /// Return true if PrepareAck or PrepareData may have something to
+  /// send.  Like them, this is called from the scheduler interrupt.
+  bool tx_pending() const { return ack_pending_ || tx_count_ != 0; }
+
+  /// Fill @p record with an acknowledgement if one is needed, and
+  /// return its size, or 0.
+  int PrepareAck(uint8_t* record, int max_size);
+
+  /// Fill @p record with the next data segment to send, using at most
+  /// @p max_size bytes, and return its size, or 0.  This must be
+  /// called once for each packet sent, even if there is no room, as
+  /// retransmissions are timed in packets.
+  int PrepareData(uint8_t* record, int max_size);
+
+  void HandleData(const uint8_t* record, int size);
+  void HandleAck(const uint8_t* record, int size);
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  void Deliver();
+
+  // The transmit side.
+  struct Segment {
+    uint16_t offset = 0;
+    uint8_t size = 0;
+    bool acked = false;
+    uint16_t sent_packet = 0;
+  };
+
+  uint8_t tx_buffer_[kBufferSize] = {};
+  // The first unacknowledged byte, and the total number buffered.
+  uint16_t tx_start_ = 0;
+  uint16_t tx_count_ = 0;
+  // The number of buffered bytes already cut into segments.
+  uint16_t tx_cut_ = 0;
+  Segment segments_[kWindow] = {};
+  uint8_t base_seq_ = 0;
+  uint8_t next_seq_ = 0;
+  // Our stream only starts once an ack has told us which epoch the
+  // peer last followed.  Epochs are stored as the record's top bit.
+  bool tx_synced_ = false;
+  uint8_t tx_epoch_ = 0;
+  uint16_t packet_count_ = 0;
+
+  // The receive side.
+  struct RxSegment {
+    bool valid = false;
+    uint8_t size = 0;
+    uint8_t data[kMaxSegmentSize] = {};
+  };
+
+  RxSegment rx_segments_[kWindow] = {};
+  uint8_t rx_buffer_[kBufferSize] = {};
+  uint16_t rx_start_ = 0;
+  uint16_t rx_count_ = 0;
+  uint8_t rx_next_seq_ = 0;
+  uint8_t rx_epoch_ = 0;
+  bool rx_synced_ = false;
+  volatile bool ack_pending_ = false;
+
+  Stats stats_;
+};
+
+}
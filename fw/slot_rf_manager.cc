@@ -14,6 +14,9 @@
 
 #include "fw/slot_rf_manager.h"
 
+#include <inttypes.h>
+
+#include <cstring>
 #include <optional>
 
 #include "fw/slot_rf_protocol.h"
@@ -25,15 +28,20 @@ namespace fw {
 namespace {
 struct Config {
   bool ptx = true;
-  std::array<uint32_t, SlotRfProtocol::kNumRemotes> ids = {
+  std::array<uint32_t, SlotRfProtocol::kMaxRemotes> ids = {
     0x30251023,
-    0,
   };
   int32_t data_rate = 1000000;
   int32_t output_power = 0;
   int32_t auto_retransmit_count = 0;
   bool print_channels = false;
+  bool print_timestamps = false;
+  bool print_counters = false;
   int32_t transmit_timeout_ms = 1000;
+  int32_t slot_period_us = 20000;
+  // If non-zero, output is gathered and sent every this many USB
+  // frames (milliseconds), on the frame boundary.
+  int32_t emit_window_ms = 0;
 
   template <typename Archive>
   void Serialize(Archive* a) {
@@ -43,10 +51,157 @@ struct Config {
     a->Visit(MJ_NVP(output_power));
     a->Visit(MJ_NVP(auto_retransmit_count));
     a->Visit(MJ_NVP(print_channels));
+    a->Visit(MJ_NVP(print_timestamps));
+    a->Visit(MJ_NVP(print_counters));
     a->Visit(MJ_NVP(transmit_timeout_ms));
+    a->Visit(MJ_NVP(slot_period_us));
+    a->Visit(MJ_NVP(emit_window_ms));
+  }
+};
+
+struct ChannelTelemetry {
+  std::array<SlotRfProtocol::ChannelStats,
+             SlotRfProtocol::kMaxRemotes> remotes;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(remotes));
+  }
+};
+
+struct RemoteTelemetry {
+  std::array<SlotRfProtocol::RemoteStats,
+             SlotRfProtocol::kMaxRemotes> remotes;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(remotes));
+  }
+};
+
+struct BulkTelemetry {
+  struct Remote {
+    SlotBulkStream::Stats stats;
+    /// Bytes per second acknowledged by the peer, and delivered to
+    /// the host, over the last kGoodputPeriodMs.
+    uint32_t tx_goodput = 0;
+    uint32_t rx_goodput = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(stats));
+      a->Visit(MJ_NVP(tx_goodput));
+      a->Visit(MJ_NVP(rx_goodput));
+    }
+  };
+
+  std::array<Remote, SlotRfProtocol::kMaxRemotes> remotes;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(remotes));
+  }
+};
+
+// Refreshes are timed with the 32 bit microsecond counter.
+constexpr uint32_t kMaxRefreshMs = 3600000;
+
+constexpr int32_t kGoodputPeriodMs = 1000;
+
+// The most received bulk data to put on one line.
+constexpr int kMaxBulkLine = 64;
+
+// Enough for a text bulk line with kMaxBulkLine bytes.
+constexpr int kMaxBulkRecord = 16 + 2 * kMaxBulkLine;
+
+// The most channel changes to hold while output is busy.
+constexpr int kChannelQueueSize = 8;
+
+// Binary mode frame types.  Requests from the host have the top bit
+// clear, everything from us has it set.  Multi-byte values are little
+// endian.
+enum FrameType : uint8_t {
+  kFrameTx = 0x01,  // remote, slot, data
+  kFramePri = 0x02,  // remote, slot, u32 priority
+  kFrameStat = 0x03,  // remote
+  kFrameBulk = 0x04,  // remote, data
+  kFrameText = 0x05,  // return to text mode
+
+  kFrameResult = 0x81,  // request type, status
+  kFrameRcv = 0x82,  // remote, u32 timestamp_us, slots in air format
+  kFrameStatReply = 0x83,  // remote, u32 sent, acked, lost, received,
+                           // malformed, resyncs, lock_us
+  kFrameChan = 0x84,  // channel
+  kFrameBulkData = 0x85,  // remote, data
+  kFramePeriodRejected = 0x86,  // u32 rejected, u32 in use
+};
+
+enum FrameStatus : uint8_t {
+  kStatusOk = 0,
+  kStatusInvalid = 1,
+  kStatusFull = 2,
+};
+
+// Counters to compare the cost of the two host encodings.
+struct HostTelemetry {
+  FramedReadStream::Stats framing;
+
+  // Received slot output: records (one per packet), bytes, and total
+  // time spent formatting them.
+  uint32_t text_records = 0;
+  uint32_t text_bytes = 0;
+  uint32_t text_format_us = 0;
+  uint32_t binary_records = 0;
+  uint32_t binary_bytes = 0;
+  uint32_t binary_format_us = 0;
+
+  // Requests handled, and total time spent parsing and acting on
+  // them.
+  uint32_t text_commands = 0;
+  uint32_t text_command_us = 0;
+  uint32_t binary_commands = 0;
+  uint32_t binary_command_us = 0;
+
+  // Channel changes which were discarded because too many were
+  // waiting to be printed.
+  uint32_t channels_dropped = 0;
+
+  // Writes to the host, each of which carries all the records which
+  // were waiting for it.
+  uint32_t writes = 0;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(framing));
+    a->Visit(MJ_NVP(text_records));
+    a->Visit(MJ_NVP(text_bytes));
+    a->Visit(MJ_NVP(text_format_us));
+    a->Visit(MJ_NVP(binary_records));
+    a->Visit(MJ_NVP(binary_bytes));
+    a->Visit(MJ_NVP(binary_format_us));
+    a->Visit(MJ_NVP(text_commands));
+    a->Visit(MJ_NVP(text_command_us));
+    a->Visit(MJ_NVP(binary_commands));
+    a->Visit(MJ_NVP(binary_command_us));
+    a->Visit(MJ_NVP(channels_dropped));
+    a->Visit(MJ_NVP(writes));
   }
 };
 
+void WriteU32(char* data, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data[i] = (value >> (i * 8)) & 0xff;
+  }
+}
+
+uint32_t ReadU32(const char* data) {
+  uint32_t result = 0;
+  for (int i = 0; i < 4; i++) {
+    result |= static_cast<uint32_t>(static_cast<uint8_t>(data[i])) << (i * 8);
+  }
+  return result;
+}
+
 int ParseHexNybble(char c) {
   if (c >= '0' && c <= '9') { return c - '0'; }
   if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
@@ -67,12 +222,31 @@ class SlotRfManager::Impl {
  public:
   Impl(mjlib::micro::PersistentConfig& persistent_config,
        mjlib::micro::CommandManager& command_manager,
+       mjlib::micro::TelemetryManager& telemetry_manager,
        mjlib::micro::AsyncExclusive<mjlib::micro::AsyncWriteStream>& stream,
        fw::MillisecondTimer* timer,
        const Options& options)
       : options_(options),
         timer_(timer),
         stream_(stream) {
+    nrf_stats_updater_ = telemetry_manager.Register("nrf", &nrf_stats_);
+    slot_stats_updater_ =
+        telemetry_manager.Register("slot_stats", &slot_stats_);
+    channel_updater_ =
+        telemetry_manager.Register("slot_channels", &channel_telemetry_);
+    remote_updater_ =
+        telemetry_manager.Register("slot_remotes", &remote_telemetry_);
+    bulk_updater_ =
+        telemetry_manager.Register("slot_bulk", &bulk_telemetry_);
+    host_updater_ =
+        telemetry_manager.Register("slot_host", &host_telemetry_);
+
+    if (options_.host_stream) {
+      options_.host_stream->SetFrameHandler([this](auto payload) {
+          return this->HandleFrame(payload);
+        });
+    }
+
     // Default all slots to sending all the time.
     for (auto& priority_remote : priorities_) {
       for (auto& priority : priority_remote.priorities) {
@@ -95,23 +269,25 @@ class SlotRfManager::Impl {
   void Poll() {
     slot_->Poll();
 
-    for (size_t remote_index = 0;
-         remote_index < SlotRfProtocol::kNumRemotes;
-         remote_index++) {
-      auto* remote = slot_->remote(remote_index);
-      auto& last_bitfield = last_bitfields_[remote_index];
-      const auto current = remote->slot_bitfield();
-      if (current != last_bitfield) {
-        EmitSlots(remote, remote_index, current ^ last_bitfield);
-      }
-      last_bitfield = current;
-    }
-
     const auto channel = slot_->channel();
     if (config_.print_channels && channel != last_channel_) {
-      EmitChannel(channel);
+      QueueChannel(channel);
     }
     last_channel_ = channel;
+
+    EmitPending();
+  }
+
+  // Invoked with the start of frames seen since the last call, of
+  // which there may be several if the main loop was slow.
+  void PollFrame(uint32_t frames) {
+    if (config_.emit_window_ms <= 0) { return; }
+
+    window_frames_ += frames;
+    if (window_frames_ >= config_.emit_window_ms) {
+      window_frames_ = 0;
+      window_due_ = true;
+    }
   }
 
   void PollMillisecond() {
@@ -120,59 +296,336 @@ class SlotRfManager::Impl {
       DisableTransmit();
     }
     slot_->PollMillisecond();
+
+    nrf_stats_ = slot_->nrf_stats();
+    nrf_stats_updater_();
+
+    slot_stats_ = slot_->stats();
+    slot_stats_updater_();
+
+    for (int i = 0; i < SlotRfProtocol::kMaxRemotes; i++) {
+      channel_telemetry_.remotes[i] = slot_->remote(i)->channel_stats();
+    }
+    channel_updater_();
+
+    for (int i = 0; i < SlotRfProtocol::kMaxRemotes; i++) {
+      remote_telemetry_.remotes[i] = slot_->remote(i)->remote_stats();
+    }
+    remote_updater_();
+
+    UpdateBulkTelemetry();
+
+    if (options_.host_stream) {
+      host_telemetry_.framing = options_.host_stream->stats();
+    }
+    host_updater_();
   }
 
  private:
-  void EmitChannel(uint8_t channel) {
+  bool binary() const {
+    return options_.host_stream && options_.host_stream->binary();
+  }
+
+  void QueueChannel(uint8_t channel) {
+    if (channel_queue_count_ == kChannelQueueSize) {
+      channel_queue_start_ = (channel_queue_start_ + 1) % kChannelQueueSize;
+      channel_queue_count_--;
+      host_telemetry_.channels_dropped++;
+    }
+    channel_queue_[(channel_queue_start_ + channel_queue_count_) %
+                   kChannelQueueSize] = channel;
+    channel_queue_count_++;
+  }
+
+  // Gather everything waiting to go to the host into one write.
+  void EmitPending() {
     if (write_outstanding_) { return; }
 
-    snprintf(emit_line_, sizeof(emit_line_), "chan %d\r\n", channel);
+    // With a window configured, output only goes out on the window's
+    // USB frames, except for replies to binary requests.
+    if (config_.emit_window_ms > 0 && !window_due_ && reply_size_ == 0) {
+      return;
+    }
+    window_due_ = false;
+
+    emit_size_ = 0;
+    AppendReply();
+    AppendPeriodRejected();
+    while (AppendRxPacket()) {}
+    for (size_t remote_index = 0;
+         remote_index < SlotRfProtocol::kMaxRemotes;
+         remote_index++) {
+      AppendBulk(remote_index);
+    }
+    while (AppendChannel()) {}
+
+    if (emit_size_ == 0) { return; }
 
-    EmitLine();
+    host_telemetry_.writes++;
+    EmitData(std::string_view(emit_buffer_, emit_size_));
   }
 
-  void EmitSlots(SlotRfProtocol::Remote* remote, int remote_index, uint32_t slots) {
-    if (write_outstanding_) { return; }
+  // Add @p record to the pending write if there is room, and return
+  // true if so.
+  bool Append(std::string_view record) {
+    if (emit_size_ + static_cast<int>(record.size()) >
+        static_cast<int>(sizeof(emit_buffer_))) {
+      return false;
+    }
+    std::memcpy(&emit_buffer_[emit_size_], record.data(), record.size());
+    emit_size_ += record.size();
+    return true;
+  }
+
+  bool AppendFrame(std::string_view payload) {
+    const int size = FramedReadStream::EncodeFrame(payload, record_);
+    return Append(std::string_view(record_, size));
+  }
+
+  // The config system has no way to refuse a value, so report a
+  // rejected slot period on the output instead.
+  void AppendPeriodRejected() {
+    if (!period_rejected_) { return; }
+
+    if (binary()) {
+      char payload[9] = {};
+      payload[0] = kFramePeriodRejected;
+      WriteU32(&payload[1], rejected_slot_period_us_);
+      WriteU32(&payload[5], config_.slot_period_us);
+      if (!AppendFrame(std::string_view(payload, sizeof(payload)))) {
+        return;
+      }
+    } else {
+      const int size = snprintf(
+          record_, sizeof(record_),
+          "ERR slot_period_us %" PRId32 " rejected, using %" PRId32 "\r\n",
+          rejected_slot_period_us_, config_.slot_period_us);
+      if (!Append(std::string_view(record_, size))) { return; }
+    }
+    period_rejected_ = false;
+  }
+
+  bool AppendChannel() {
+    if (channel_queue_count_ == 0) { return false; }
+
+    const uint8_t channel = channel_queue_[channel_queue_start_];
+    if (binary()) {
+      const char payload[] = { static_cast<char>(kFrameChan),
+                               static_cast<char>(channel) };
+      if (!AppendFrame(std::string_view(payload, sizeof(payload)))) {
+        return false;
+      }
+    } else {
+      const int size =
+          snprintf(record_, sizeof(record_), "chan %d\r\n", channel);
+      if (!Append(std::string_view(record_, size))) { return false; }
+    }
+
+    channel_queue_start_ = (channel_queue_start_ + 1) % kChannelQueueSize;
+    channel_queue_count_--;
+    return true;
+  }
+
+  // Add one record for all the slots received in the oldest packet
+  // still in the log.  The events stay in the log if it does not fit.
+  bool AppendRxPacket() {
+    if (!slot_->rx_event(0)) { return false; }
+
+    const uint32_t start_us = timer_->read_us();
+    int count = 0;
+    if (binary()) {
+      const int size = FormatRxFrame(&count);
+      if (!Append(std::string_view(record_, size))) { return false; }
+      host_telemetry_.binary_records++;
+      host_telemetry_.binary_bytes += size;
+      host_telemetry_.binary_format_us += timer_->read_us() - start_us;
+    } else {
+      const int size = FormatRxLine(&count);
+      if (!Append(std::string_view(record_, size))) { return false; }
+      host_telemetry_.text_records++;
+      host_telemetry_.text_bytes += size;
+      host_telemetry_.text_format_us += timer_->read_us() - start_us;
+    }
+    slot_->ConsumeRxEvents(count);
+    return true;
+  }
+
+  // Return the number of events in the oldest packet in the log.
+  int CountPacketEvents() const {
+    const auto* const first = slot_->rx_event(0);
+    int count = 0;
+    while (true) {
+      const auto* const event = slot_->rx_event(count);
+      if (!event || event->packet != first->packet) {
+        return count;
+      }
+      count++;
+    }
+  }
+
+  // Both formatters leave the record in record_, return its size, and
+  // set @p count to how many events it holds.
+  int FormatRxFrame(int* count) {
+    const auto* const first = slot_->rx_event(0);
+
+    char payload[FramedReadStream::kMaxPayloadSize] = {};
+    int size = 0;
+    payload[size++] = kFrameRcv;
+    payload[size++] = first->remote;
+    WriteU32(&payload[size], first->timestamp_us);
+    size += 4;
+
+    // Anything which does not fit goes in the next frame.
+    const int available = CountPacketEvents();
+    *count = 0;
+    for (; *count < available; (*count)++) {
+      const auto* const event = slot_->rx_event(*count);
+      if (size + 1 + event->size > static_cast<int>(sizeof(payload))) {
+        break;
+      }
+      payload[size++] = (event->slot << 4) | event->size;
+      std::memcpy(&payload[size], event->data, event->size);
+      size += event->size;
+    }
+
+    return FramedReadStream::EncodeFrame(
+        std::string_view(payload, size), record_);
+  }
+
+  int FormatRxLine(int* count) {
+    const auto* const first = slot_->rx_event(0);
 
     ssize_t pos = 0;
     auto fmt = [&](auto ...args) {
-      pos += snprintf(&emit_line_[pos], sizeof(emit_line_) - pos, args...);
+      pos += snprintf(&record_[pos], sizeof(record_) - pos, args...);
+      pos = std::min<ssize_t>(pos, sizeof(record_) - 1);
     };
 
+    // A full packet of slots with counters can be longer than
+    // record_, so anything which does not fit goes in the next line.
+    constexpr ssize_t kMaxEventText =
+        4 + 2 * SlotRfProtocol::kMaxSlotSize + 11;
+    constexpr ssize_t kMaxTrailerText = 11 + 24 + 2;
+
     fmt("rcv");
-    if (remote_index > 0) {
-      fmt("2 %d", remote_index);
+    if (first->remote > 0) {
+      fmt("2 %d", first->remote);
     }
 
-    for (int slot_index = 0;
-         slot_index < SlotRfProtocol::kNumSlots;
-         slot_index++) {
-      const uint32_t mask = 0x3 << (slot_index * 2);
-      if ((slots & mask) == 0) { continue; }
-
-      fmt(" %d:", slot_index);
+    const int available = CountPacketEvents();
+    *count = 0;
+    for (; *count < available; (*count)++) {
+      if (*count > 0 &&
+          pos + kMaxEventText + kMaxTrailerText >
+          static_cast<ssize_t>(sizeof(record_))) {
+        break;
+      }
+      const auto* const event = slot_->rx_event(*count);
 
-      const auto& slot = remote->rx_slot(slot_index);
-      for (int i = 0; i < slot.size; i++) {
-        fmt("%02X", slot.data[i]);
+      fmt(" %d:", event->slot);
+      for (int i = 0; i < event->size; i++) {
+        fmt("%02X", event->data[i]);
+      }
+      if (config_.print_counters) {
+        fmt("/%" PRIu32, event->seq);
       }
     }
 
     if (slot_->error()) {
       fmt(" E%X", slot_->error());
     }
+    if (config_.print_timestamps) {
+      // When the packet arrived, and how long ago that was as we hand
+      // it to the host.
+      fmt(" T%" PRIu32 " A%" PRIu32,
+          first->timestamp_us, timer_->read_us() - first->timestamp_us);
+    }
+    fmt("\r\n");
+
+    return pos;
+  }
+
+  void AppendBulk(int remote_index) {
+    auto* const bulk = slot_->remote(remote_index)->bulk();
+    if (!bulk->read_available()) { return; }
+
+    // Reading consumes the data, so only start if the largest record
+    // is sure to fit.
+    const int max_size =
+        binary() ? FramedReadStream::kMaxEncodedSize : kMaxBulkRecord;
+    if (emit_size_ + max_size > static_cast<int>(sizeof(emit_buffer_))) {
+      return;
+    }
+
+    if (binary()) {
+      char payload[FramedReadStream::kMaxPayloadSize] = {};
+      payload[0] = kFrameBulkData;
+      payload[1] = remote_index;
+      const int size = bulk->Read(
+          reinterpret_cast<uint8_t*>(&payload[2]), sizeof(payload) - 2);
+      AppendFrame(std::string_view(payload, size + 2));
+      return;
+    }
+
+    ssize_t pos = 0;
+    auto fmt = [&](auto ...args) {
+      pos += snprintf(&record_[pos], sizeof(record_) - pos, args...);
+      pos = std::min<ssize_t>(pos, sizeof(record_) - 1);
+    };
+
+    fmt("bulk");
+    if (remote_index > 0) {
+      fmt("2 %d", remote_index);
+    }
+    fmt(" ");
+
+    uint8_t data[kMaxBulkLine] = {};
+    const int size = bulk->Read(data, sizeof(data));
+    for (int i = 0; i < size; i++) {
+      fmt("%02X", data[i]);
+    }
     fmt("\r\n");
 
-    EmitLine();
+    Append(std::string_view(record_, pos));
+  }
+
+  void UpdateBulkTelemetry() {
+    bulk_ms_++;
+    const bool update_goodput = bulk_ms_ >= kGoodputPeriodMs;
+    if (update_goodput) { bulk_ms_ = 0; }
+
+    for (int i = 0; i < SlotRfProtocol::kMaxRemotes; i++) {
+      auto& remote = bulk_telemetry_.remotes[i];
+      remote.stats = slot_->remote(i)->bulk()->stats();
+
+      if (update_goodput) {
+        auto& mark = bulk_marks_[i];
+        remote.tx_goodput = (remote.stats.tx_acked_bytes - mark.tx_bytes) *
+            1000 / kGoodputPeriodMs;
+        remote.rx_goodput = (remote.stats.rx_bytes - mark.rx_bytes) *
+            1000 / kGoodputPeriodMs;
+        mark.tx_bytes = remote.stats.tx_acked_bytes;
+        mark.rx_bytes = remote.stats.rx_bytes;
+      }
+    }
+    bulk_updater_();
+  }
+
+  // Add any response to a binary request.  These go ahead of
+  // everything else.
+  void AppendReply() {
+    if (reply_size_ == 0) { return; }
+    if (Append(std::string_view(reply_, reply_size_))) { reply_size_ = 0; }
   }
 
-  void EmitLine() {
+  // @p data must remain valid until the write completes.
+  void EmitData(std::string_view data) {
     write_outstanding_ = true;
     stream_.AsyncStart(
-        [this](micro::AsyncWriteStream* write_stream,
-               micro::VoidCallback done_callback) {
+        [this, data](micro::AsyncWriteStream* write_stream,
+                     micro::VoidCallback done_callback) {
           done_callback_ = done_callback;
-          micro::AsyncWrite(*write_stream, emit_line_, [this](auto ec) {
+          micro::AsyncWrite(*write_stream, data, [this](auto ec) {
               auto done = this->done_callback_;
               this->done_callback_ = {};
               this->write_outstanding_ = false;
@@ -186,53 +639,119 @@ class SlotRfManager::Impl {
   }
 
   void Restart() {
-    slot_.emplace(
-        timer_,
-        [&]() {
-          SlotRfProtocol::Options options;
-          options.pins = options_.pins;
-
-          options.ptx = config_.ptx;
-          options.ids = config_.ids;
-          options.data_rate = config_.data_rate;
-          options.output_power = config_.output_power;
-          options.auto_retransmit_count = config_.auto_retransmit_count;
-
-          return options;
-        }());
+    auto options = MakeOptions();
+    if (!SlotRfProtocol::ValidateSlotPeriod(options)) {
+      // Reject the period by going back to the last one we used.  If
+      // some other change made that one infeasible too, we run with
+      // it anyway, as the firmware always has.
+      period_rejected_ = true;
+      rejected_slot_period_us_ = config_.slot_period_us;
+      config_.slot_period_us = last_slot_period_us_;
+      options = MakeOptions();
+    }
+    last_slot_period_us_ = config_.slot_period_us;
+
+    slot_.emplace(timer_, options);
     slot_->Start();
+
+    // The bulk streams start over along with the protocol.
+    bulk_marks_ = {};
+  }
+
+  SlotRfProtocol::Options MakeOptions() const {
+    SlotRfProtocol::Options options;
+    options.pins = options_.pins;
+
+    options.ptx = config_.ptx;
+    options.ids = config_.ids;
+    options.data_rate = config_.data_rate;
+    options.output_power = config_.output_power;
+    options.auto_retransmit_count = config_.auto_retransmit_count;
+    options.slot_period_us = config_.slot_period_us;
+
+    return options;
   }
 
   void Command(const std::string_view& command,
                const micro::CommandManager::Response& response) {
+    const uint32_t start_us = timer_->read_us();
+    DispatchCommand(command, response);
+    host_telemetry_.text_commands++;
+    host_telemetry_.text_command_us += timer_->read_us() - start_us;
+  }
+
+  void DispatchCommand(const std::string_view& command,
+                       const micro::CommandManager::Response& response) {
     mjlib::base::Tokenizer tokenizer(command, " ");
 
+    // "tx", "pri" and "chg" take an optional leading remote index,
+    // which is present if there are 3 arguments, and "bulk" if there
+    // are 2.  "tx2", "pri2", "chg2" and "bulk2" always require it.
     auto cmd = tokenizer.next();
+    const auto remaining = tokenizer.remaining();
     if (cmd == "tx") {
-      Command_Tx(0, tokenizer.remaining(), response);
+      CommandWithRemote(
+          CountTokens(remaining) >= 3, remaining, response,
+          &Impl::Command_Tx);
     } else if (cmd == "tx2") {
-      Command_Tx2(tokenizer.remaining(), response);
+      CommandWithRemote(true, remaining, response, &Impl::Command_Tx);
     } else if (cmd == "pri") {
-      Command_Pri(0, tokenizer.remaining(), response);
+      CommandWithRemote(
+          CountTokens(remaining) >= 3, remaining, response,
+          &Impl::Command_Pri);
     } else if (cmd == "pri2") {
-      Command_Pri2(tokenizer.remaining(), response);
+      CommandWithRemote(true, remaining, response, &Impl::Command_Pri);
+    } else if (cmd == "chg") {
+      CommandWithRemote(
+          CountTokens(remaining) >= 3, remaining, response,
+          &Impl::Command_Chg);
+    } else if (cmd == "chg2") {
+      CommandWithRemote(true, remaining, response, &Impl::Command_Chg);
+    } else if (cmd == "bulk") {
+      CommandWithRemote(
+          CountTokens(remaining) >= 2, remaining, response,
+          &Impl::Command_Bulk);
+    } else if (cmd == "bulk2") {
+      CommandWithRemote(true, remaining, response, &Impl::Command_Bulk);
+    } else if (cmd == "bin") {
+      Command_Bin(response);
     } else {
       WriteMessage("ERR unknown command\r\n", response);
     }
   }
 
-  void Command_Tx2(std::string_view command,
-                   const micro::CommandManager::Response& response) {
+  static int CountTokens(std::string_view command) {
     mjlib::base::Tokenizer tokenizer(command, " ");
-    auto remote_index_str = tokenizer.next();
+    int result = 0;
+    while (!tokenizer.next().empty()) { result++; }
+    return result;
+  }
 
-    const int remote_index =
-        std::max<int>(
-            0, std::min<int>(
-                SlotRfProtocol::kNumRemotes - 1,
-                std::strtol(remote_index_str.data(), nullptr, 0)));
+  using RemoteCommand = void (Impl::*)(
+      int, std::string_view, const micro::CommandManager::Response&);
+
+  void CommandWithRemote(bool has_remote,
+                         std::string_view command,
+                         const micro::CommandManager::Response& response,
+                         RemoteCommand handler) {
+    if (!has_remote) {
+      (this->*handler)(0, command, response);
+      return;
+    }
+
+    mjlib::base::Tokenizer tokenizer(command, " ");
+    const auto remote_index_str = tokenizer.next();
+    char* end = nullptr;
+    const int remote_index = std::strtol(remote_index_str.data(), &end, 0);
+    if (remote_index_str.empty() ||
+        end != remote_index_str.data() + remote_index_str.size() ||
+        remote_index < 0 ||
+        remote_index >= SlotRfProtocol::kMaxRemotes) {
+      WriteMessage("ERR invalid remote\r\n", response);
+      return;
+    }
 
-    Command_Tx(remote_index, tokenizer.remaining(), response);
+    (this->*handler)(remote_index, tokenizer.remaining(), response);
   }
 
   void Command_Tx(int remote_index,
@@ -247,6 +766,10 @@ class SlotRfManager::Impl {
       WriteMessage("ERR data invalid length\r\n", response);
       return;
     }
+    if (hexdata.size() > 2 * SlotRfProtocol::kMaxSlotSize) {
+      WriteMessage("ERR data too long\r\n", response);
+      return;
+    }
 
     const int slot_index =
         std::max<int>(
@@ -254,38 +777,34 @@ class SlotRfManager::Impl {
                 SlotRfProtocol::kNumSlots - 1,
                 std::strtol(slot_str.data(), nullptr, 0)));
 
-    SlotRfProtocol::Slot slot;
-    slot.size = hexdata.size() / 2;
-    slot.priority = priorities_[remote_index].priorities[slot_index];
-
+    uint8_t data[SlotRfProtocol::kMaxSlotSize] = {};
     for (size_t i = 0; i < hexdata.size(); i += 2) {
       const int value = ParseHexByte(&hexdata[i]);
       if (value < 0) {
         WriteMessage("ERR invalid data\r\n", response);
         return;
       }
-      slot.data[i / 2] = value;
+      data[i / 2] = value;
     }
 
-    slot_->remote(remote_index)->tx_slot(slot_index, slot);
-
-    timeout_remaining_ = config_.transmit_timeout_ms;
+    SetTxSlot(remote_index, slot_index, data, hexdata.size() / 2);
 
     WriteOK(response);
   }
 
-  void Command_Pri2(std::string_view command,
-                    const micro::CommandManager::Response& response) {
-    mjlib::base::Tokenizer tokenizer(command, " ");
-    auto remote_index_str = tokenizer.next();
+  void SetTxSlot(int remote_index, int slot_index,
+                 const uint8_t* data, int size) {
+    SlotRfProtocol::Slot slot;
+    slot.size = size;
+    slot.priority = priorities_[remote_index].priorities[slot_index];
+    const auto& mode = modes_[remote_index];
+    slot.on_change = (mode.on_change & (1 << slot_index)) != 0;
+    slot.refresh_ms = mode.refresh_ms[slot_index];
+    std::memcpy(slot.data, data, size);
 
-    const int remote_index =
-        std::max<int>(
-            0, std::min<int>(
-                SlotRfProtocol::kNumRemotes - 1,
-                std::strtol(remote_index_str.data(), nullptr, 0)));
+    slot_->remote(remote_index)->tx_slot(slot_index, slot);
 
-    Command_Pri(remote_index, tokenizer.remaining(), response);
+    timeout_remaining_ = config_.transmit_timeout_ms;
   }
 
   void Command_Pri(int remote_index,
@@ -309,12 +828,197 @@ class SlotRfManager::Impl {
     const uint32_t priority =
         std::strtoul(pri_str.data(), nullptr, 16);
 
+    SetPriority(remote_index, slot_index, priority);
+
+    WriteOK(response);
+  }
+
+  void SetPriority(int remote_index, int slot_index, uint32_t priority) {
     priorities_[remote_index].priorities[slot_index] = priority;
 
     auto* const remote = slot_->remote(remote_index);
     auto slot = remote->tx_slot(slot_index);
     slot.priority = priority;
     remote->tx_slot(slot_index, slot);
+  }
+
+  // Switch the host stream to binary frames.  The host should wait for
+  // the OK before sending any.
+  void Command_Bin(const micro::CommandManager::Response& response) {
+    if (!options_.host_stream) {
+      WriteMessage("ERR binary mode unavailable\r\n", response);
+      return;
+    }
+
+    options_.host_stream->SetBinary(true);
+    WriteOK(response);
+  }
+
+  // Handle one binary request.  Return false if it has to wait for
+  // the response to the last one to be sent.
+  bool HandleFrame(std::string_view payload) {
+    if (reply_size_ != 0) { return false; }
+
+    const uint32_t start_us = timer_->read_us();
+    const uint8_t type = payload[0];
+    const auto status = DispatchFrame(payload);
+    host_telemetry_.binary_commands++;
+    host_telemetry_.binary_command_us += timer_->read_us() - start_us;
+
+    // Some requests have their own reply.
+    if (reply_size_ == 0) {
+      const char result[] = { static_cast<char>(kFrameResult),
+                              static_cast<char>(type),
+                              static_cast<char>(status) };
+      reply_size_ = FramedReadStream::EncodeFrame(
+          std::string_view(result, sizeof(result)), reply_);
+    }
+    return true;
+  }
+
+  FrameStatus DispatchFrame(std::string_view payload) {
+    const int size = payload.size();
+    const uint8_t type = payload[0];
+    const int remote_index = (size >= 2) ? payload[1] : -1;
+    if (type != kFrameText &&
+        (remote_index < 0 || remote_index >= SlotRfProtocol::kMaxRemotes)) {
+      return kStatusInvalid;
+    }
+    const auto* const data = reinterpret_cast<const uint8_t*>(payload.data());
+
+    switch (type) {
+      case kFrameTx: {
+        if (size < 3) { return kStatusInvalid; }
+        const int slot_index = data[2];
+        const int slot_size = size - 3;
+        if (slot_index >= SlotRfProtocol::kNumSlots ||
+            slot_size > SlotRfProtocol::kMaxSlotSize) {
+          return kStatusInvalid;
+        }
+        SetTxSlot(remote_index, slot_index, &data[3], slot_size);
+        return kStatusOk;
+      }
+      case kFramePri: {
+        if (size != 7) { return kStatusInvalid; }
+        const int slot_index = data[2];
+        if (slot_index >= SlotRfProtocol::kNumSlots) {
+          return kStatusInvalid;
+        }
+        SetPriority(remote_index, slot_index, ReadU32(&payload[3]));
+        return kStatusOk;
+      }
+      case kFrameStat: {
+        const auto stats = slot_->remote(remote_index)->remote_stats();
+        char reply[2 + 7 * 4] = {};
+        reply[0] = kFrameStatReply;
+        reply[1] = remote_index;
+        int pos = 2;
+        for (const uint32_t value : {
+                 stats.sent, stats.acked, stats.lost, stats.received,
+                 stats.malformed, stats.resyncs, stats.lock_us}) {
+          WriteU32(&reply[pos], value);
+          pos += 4;
+        }
+        reply_size_ = FramedReadStream::EncodeFrame(
+            std::string_view(reply, sizeof(reply)), reply_);
+        return kStatusOk;
+      }
+      case kFrameBulk: {
+        auto* const bulk = slot_->remote(remote_index)->bulk();
+        const int bulk_size = size - 2;
+        if (bulk_size > bulk->write_available()) { return kStatusFull; }
+        bulk->Write(&data[2], bulk_size);
+        return kStatusOk;
+      }
+      case kFrameText: {
+        options_.host_stream->SetBinary(false);
+        return kStatusOk;
+      }
+    }
+    return kStatusInvalid;
+  }
+
+  // Switch a slot between being sent according to its priority, and
+  // being sent only when updated plus every refresh_ms:
+  //
+  //  chg [<remote>] <slot> <refresh_ms|off>
+  void Command_Chg(int remote_index,
+                   std::string_view remaining,
+                   const micro::CommandManager::Response& response) {
+    mjlib::base::Tokenizer tokenizer(remaining, " ");
+
+    auto slot_str = tokenizer.next();
+    auto refresh_str = tokenizer.next();
+
+    if (slot_str.empty() || refresh_str.empty()) {
+      WriteMessage("ERR invalid mode\r\n", response);
+      return;
+    }
+
+    const int slot_index =
+        std::max<int>(
+            0, std::min<int>(
+                SlotRfProtocol::kNumSlots - 1,
+                std::strtol(slot_str.data(), nullptr, 0)));
+
+    const bool on_change = refresh_str != "off";
+    const uint32_t refresh_ms =
+        on_change ? std::strtoul(refresh_str.data(), nullptr, 0) : 0;
+    if (refresh_ms > kMaxRefreshMs) {
+      WriteMessage("ERR refresh too long\r\n", response);
+      return;
+    }
+
+    auto& mode = modes_[remote_index];
+    if (on_change) {
+      mode.on_change |= (1 << slot_index);
+    } else {
+      mode.on_change &= ~(1 << slot_index);
+    }
+    mode.refresh_ms[slot_index] = refresh_ms;
+
+    auto* const remote = slot_->remote(remote_index);
+    auto slot = remote->tx_slot(slot_index);
+    slot.on_change = on_change;
+    slot.refresh_ms = refresh_ms;
+    remote->tx_slot(slot_index, slot);
+
+    WriteOK(response);
+  }
+
+  // Queue bytes on the bulk stream.  Nothing is queued unless all of
+  // it fits.
+  //
+  //  bulk [<remote>] <hexdata>
+  void Command_Bulk(int remote_index,
+                    std::string_view remaining,
+                    const micro::CommandManager::Response& response) {
+    mjlib::base::Tokenizer tokenizer(remaining, " ");
+    auto hexdata = tokenizer.next();
+
+    if (hexdata.empty() || (hexdata.size() % 2) != 0) {
+      WriteMessage("ERR data invalid length\r\n", response);
+      return;
+    }
+
+    uint8_t data[SlotBulkStream::kBufferSize] = {};
+    const int size = hexdata.size() / 2;
+    auto* const bulk = slot_->remote(remote_index)->bulk();
+    if (size > bulk->write_available()) {
+      WriteMessage("ERR full\r\n", response);
+      return;
+    }
+
+    for (int i = 0; i < size; i++) {
+      const int value = ParseHexByte(&hexdata[i * 2]);
+      if (value < 0) {
+        WriteMessage("ERR invalid data\r\n", response);
+        return;
+      }
+      data[i] = value;
+    }
+
+    bulk->Write(data, size);
 
     WriteOK(response);
   }
@@ -323,7 +1027,7 @@ class SlotRfManager::Impl {
     // Set all the priorities at the lower level to 0, so we stop
     // sending slots.
     for (int remote_index = 0;
-         remote_index < SlotRfProtocol::kNumRemotes;
+         remote_index < SlotRfProtocol::kMaxRemotes;
          remote_index++) {
       auto* const remote = slot_->remote(remote_index);
       for (int slot_index = 0;
@@ -350,19 +1054,65 @@ class SlotRfManager::Impl {
   micro::AsyncExclusive<micro::AsyncWriteStream>& stream_;
 
   Config config_;
+  int32_t last_slot_period_us_ = Config().slot_period_us;
+  // A rejected slot period which has not yet been reported.
+  bool period_rejected_ = false;
+  int32_t rejected_slot_period_us_ = 0;
 
   std::optional<SlotRfProtocol> slot_;
-  std::array<uint32_t, SlotRfProtocol::kNumRemotes> last_bitfields_ = {};
+
+  Nrf24l01::Stats nrf_stats_;
+  micro::StaticFunction<void()> nrf_stats_updater_;
+  SlotRfProtocol::Stats slot_stats_;
+  micro::StaticFunction<void()> slot_stats_updater_;
+  ChannelTelemetry channel_telemetry_;
+  micro::StaticFunction<void()> channel_updater_;
+  RemoteTelemetry remote_telemetry_;
+  micro::StaticFunction<void()> remote_updater_;
+  BulkTelemetry bulk_telemetry_;
+  micro::StaticFunction<void()> bulk_updater_;
+  HostTelemetry host_telemetry_;
+  micro::StaticFunction<void()> host_updater_;
+  int32_t bulk_ms_ = 0;
+
+  struct BulkMark {
+    uint32_t tx_bytes = 0;
+    uint32_t rx_bytes = 0;
+  };
+
+  std::array<BulkMark, SlotRfProtocol::kMaxRemotes> bulk_marks_ = {};
   uint8_t last_channel_ = 0;
+  uint8_t channel_queue_[kChannelQueueSize] = {};
+  int channel_queue_start_ = 0;
+  int channel_queue_count_ = 0;
 
   struct Priorities {
     uint32_t priorities[16] = {};
   };
 
-  std::array<Priorities, SlotRfProtocol::kNumRemotes> priorities_;
+  std::array<Priorities, SlotRfProtocol::kMaxRemotes> priorities_;
+
+  struct SlotModes {
+    // Bit N is set if slot N is only sent when it changes.
+    uint16_t on_change = 0;
+    uint32_t refresh_ms[16] = {};
+  };
+
+  std::array<SlotModes, SlotRfProtocol::kMaxRemotes> modes_;
 
   bool write_outstanding_ = false;
-  char emit_line_[256] = {};
+  // Output gathered for the current write, and scratch space to
+  // format one record in.
+  char emit_buffer_[1024] = {};
+  int emit_size_ = 0;
+  char record_[512] = {};
+
+  int32_t window_frames_ = 0;
+  bool window_due_ = false;
+
+  // An encoded binary reply waiting to be sent.
+  char reply_[FramedReadStream::kMaxEncodedSize] = {};
+  int reply_size_ = 0;
   micro::VoidCallback done_callback_;
 
   int32_t timeout_remaining_ = 0;
@@ -372,10 +1122,12 @@ SlotRfManager::SlotRfManager(
     micro::Pool& pool,
     micro::PersistentConfig& persistent_config,
     micro::CommandManager& command_manager,
+    micro::TelemetryManager& telemetry_manager,
     micro::AsyncExclusive<micro::AsyncWriteStream>& stream,
     MillisecondTimer* timer,
     const Options& options)
-    : impl_(&pool, persistent_config, command_manager, stream, timer, options) {
+    : impl_(&pool, persistent_config, command_manager, telemetry_manager,
+            stream, timer, options) {
 }
 
 void SlotRfManager::Poll() {
@@ -386,6 +1138,10 @@ void SlotRfManager::PollMillisecond() {
   impl_->PollMillisecond();
 }
 
+void SlotRfManager::PollFrame(uint32_t frames) {
+  impl_->PollFrame(frames);
+}
+
 void SlotRfManager::Start() {
   impl_->Start();
 }
@@ -19,7 +19,9 @@
 #include "mjlib/micro/command_manager.h"
 #include "mjlib/micro/persistent_config.h"
 #include "mjlib/micro/pool_ptr.h"
+#include "mjlib/micro/telemetry_manager.h"
 
+#include "fw/framed_read_stream.h"
 #include "fw/millisecond_timer.h"
 #include "fw/nrf24l01.h"
 
@@ -28,17 +30,27 @@ class SlotRfManager {
  public:
   struct Options {
     Nrf24l01::Pins pins;
+
+    /// If set, "slot bin" switches this to binary mode, and frames
+    /// received from it are handled here.
+    FramedReadStream* host_stream = nullptr;
   };
 
   SlotRfManager(mjlib::micro::Pool&,
                 mjlib::micro::PersistentConfig&,
                 mjlib::micro::CommandManager&,
+                mjlib::micro::TelemetryManager&,
                 mjlib::micro::AsyncExclusive<mjlib::micro::AsyncWriteStream>&,
                 MillisecondTimer*,
                 const Options&);
 
   void Poll();
   void PollMillisecond();
+
+  /// Invoke with the number of USB start of frames seen since the
+  /// last call.  This times the output window set by the
+  /// emit_window_ms config option.
+  void PollFrame(uint32_t frames);
   void Start();
 
  private:
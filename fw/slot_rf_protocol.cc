@@ -14,16 +14,134 @@
 
 #include "fw/slot_rf_protocol.h"
 
+#include <algorithm>
+
 #include "mjlib/base/visitor.h"
 #include "mjlib/micro/static_vector.h"
 
+#include "fw/stm32g4_deadline_timer.h"
+
 namespace micro = mjlib::micro;
 
 namespace fw {
 
 namespace {
-constexpr int kSlotPeriodMs = 20;
-constexpr int kNumChannels = 23;
+constexpr int32_t kTickUs = 250;
+constexpr int kNumChannels = SlotRfProtocol::kNumChannels;
+
+// The nRF24L01 supports RF channels below this.
+constexpr uint8_t kMaxRfChannel = 125;
+
+// Channels held in reserve to replace ones which perform badly.
+constexpr int kNumSpareChannels = 8;
+
+// A hop position is replaced once its weighted success rate drops
+// below this, out of 255, with at least kMinQualitySamples behind it.
+constexpr int kSwapQuality = 128;
+constexpr int kMinQualitySamples = 32;
+
+// Slot index 15 carries extended records.  The header size field is
+// the record size, and the first record byte is its type.
+constexpr int kRecordSlot = 15;
+constexpr uint8_t kRecordHopChange = 1;
+constexpr uint8_t kRecordBulkData = 2;
+constexpr uint8_t kRecordBulkAck = 3;
+
+// A packet with nothing to carry holds just this byte, since the
+// radio will not send an empty payload.  It would otherwise parse as
+// a truncated record.
+constexpr uint8_t kPlaceholder = 0xff;
+
+// After a hop change takes effect, the transmitter keeps announcing
+// it for this many cycles, so a receiver which missed the countdown
+// still catches up.
+constexpr int32_t kHopChangeLingerCycles = 2;
+
+// Transmitters switch to the next remote's ID and channel this long
+// before they transmit to it, which covers the 130us PLL settling.
+constexpr int kHopLeadTicks = 2;
+
+constexpr int32_t kAutoRetransmitDelayUs = 1000;
+
+// The time for the radio to switch between standby, RX and TX.
+constexpr int32_t kSettleUs = 130;
+
+// A receiver which is searching spends every other period listening
+// on a single channel, and moves to the next after this many listening
+// periods.  The transmitter sequence advances once per period, so this
+// scales with the period.
+constexpr int kSyncDwellPeriods = 20;
+
+// Once a locked receiver has missed packets for the lock loss time,
+// it coasts, continuing to hop on its own clock.  It gives up and
+// searches once this much time has passed without a packet, or once
+// the possible clock error could put the transmitter's packets
+// outside the room the receive hop leaves either side of where we
+// expect them.
+constexpr uint32_t kCoastTimeoutUs = 3000000;
+// Two crystals at +-50ppm each.
+constexpr uint32_t kClockTolerancePpm = 100;
+
+// After the RPD sweep sees energy, we follow the hop sequence from
+// there for this many periods waiting for a packet before going back
+// to searching.
+constexpr int kAcquireMissLimit = 3;
+
+// A locked receiver goes back to synchronizing after it has missed
+// packets for this long, but never after fewer than kMinLockLoss.
+constexpr int32_t kLockLossUs = 100000;
+constexpr int kMinLockLoss = 5;
+
+// The on air time of a packet: 1 byte preamble, 5 byte address, 9 bit
+// packet control field, payload and 2 byte CRC.
+int32_t PacketAirtimeUs(int32_t data_rate, int payload_size) {
+  const int32_t bits = (1 + 5 + payload_size + 2) * 8 + 9;
+  return (bits * 1000000 + data_rate - 1) / data_rate;
+}
+
+// The worst case time for a packet with the given payload size, its
+// acknowledgement with a full ack payload, and all retransmissions.
+int32_t ExchangeUs(const SlotRfProtocol::Options& options,
+                   int tx_payload_size) {
+  const int32_t single_us =
+      2 * kSettleUs +
+      PacketAirtimeUs(options.data_rate, tx_payload_size) +
+      PacketAirtimeUs(options.data_rate, Nrf24l01::kMaxPayloadSize);
+  return (options.auto_retransmit_count + 1) * single_us +
+      options.auto_retransmit_count * kAutoRetransmitDelayUs;
+}
+
+int32_t MaxExchangeUs(const SlotRfProtocol::Options& options) {
+  return ExchangeUs(options, Nrf24l01::kMaxPayloadSize);
+}
+
+// A receiver hops once per period, between the packets it expects.
+// Before it hops, it must have sent the ack payload for the last
+// packet.  After it hops, the PLL must settle before the next packet's
+// exchange begins.  The hop is placed on the tick which leaves the
+// most room either side for a packet to be early or late.
+struct ReceiveHop {
+  // When to hop, in ticks after the expected packet.
+  int ticks = 0;
+  // How far a packet may be from where it was expected and still be
+  // heard.
+  int32_t margin_us = 0;
+};
+
+ReceiveHop PlanReceiveHop(const SlotRfProtocol::Options& options,
+                          int32_t period_us) {
+  const int32_t ack_us =
+      kSettleUs +
+      PacketAirtimeUs(options.data_rate, Nrf24l01::kMaxPayloadSize);
+  const int32_t before_us = MaxExchangeUs(options) + kHopLeadTicks * kTickUs;
+
+  ReceiveHop result;
+  result.ticks = std::max<int32_t>(
+      1, (period_us - before_us + ack_us) / (2 * kTickUs));
+  const int32_t hop_us = result.ticks * kTickUs;
+  result.margin_us = std::min(hop_us - ack_us, period_us - hop_us - before_us);
+  return result;
+}
 
 uint64_t SelectShockburstId(uint32_t slot_id) {
   const auto byte_lsb = 0xc0 | (slot_id & 0x0f);
@@ -53,7 +171,10 @@ class SlotRfProtocol::Impl {
   Impl(fw::MillisecondTimer* timer,
        const Options& options)
       : options_(options),
-        timer_(timer) {
+        timer_(timer),
+        deadline_timer_([this](uint32_t deadline_us) {
+            this->HandleTick(deadline_us);
+          }) {
   }
 
   void Start() {
@@ -64,95 +185,339 @@ class SlotRfProtocol::Impl {
     MJ_ASSERT(!!nrf_);
     nrf_->Poll();
 
-    if (!nrf_->is_data_ready()) {
-      return;
-    }
+    // The driver may have queued several packets since we last
+    // looked.
+    while (nrf_->is_data_ready()) {
+      rx_packet_.size = 0;
+      nrf_->Read(&rx_packet_);
+      uint32_t rx_cycle = cycle_;
+
+      // If we are a receiver, we need to mark ourselves as now locked
+      // and update slot_timer_ to be ready for the next reception
+      // cycle.  The next tick is timed from when the packet actually
+      // arrived, not from when we got around to reading it.
+      if (!options_.ptx) {
+        CriticalSectionLock lock;
+
+        if (receive_mode_ == kCoasting) {
+          stats_.coast_recoveries++;
+        } else if (receive_mode_ != kLocked) {
+          const uint32_t time_to_lock_us =
+              rx_packet_.timestamp_us - search_start_us_;
+          stats_.acquisitions++;
+          stats_.time_to_lock_us = time_to_lock_us;
+          stats_.max_time_to_lock_us =
+              std::max(stats_.max_time_to_lock_us, time_to_lock_us);
+          lock_start_us_ = rx_packet_.timestamp_us;
+        }
 
-    rx_packet_.size = 0;
-    nrf_->Read(&rx_packet_);
+        // Take our place in the hop sequence from where the packet
+        // actually arrived, which matters if we were searching.
+        const int position =
+            remotes_.front().find_position(rx_packet_.channel);
+        if (position >= 0) { SetPosition(position); }
+        rx_cycle = cycle_;
+
+        receive_mode_ = kLocked;
+        last_rx_us_ = rx_packet_.timestamp_us;
+        slot_timer_ = period_ticks_;
+        rx_miss_count_ = 0;
+        rx_since_hop_ = true;
+        // We may be reading this well after it arrived, in which case
+        // the tick catches up from the packet, see HandleTick.
+        rx_anchored_ = true;
+        deadline_timer_.Schedule(rx_packet_.timestamp_us + kTickUs);
+
+        remotes_.front().UpdateQuality(channel_index_, true);
+        UpdateLockTime(rx_packet_.timestamp_us);
+      }
 
-    // If we are a receiver, we need to mark ourselves as now locked
-    // and update slot_timer_ to be ready for the next reception
-    // cycle.
-    if (!options_.ptx) {
-      receive_mode_ = kLocked;
-      slot_timer_ = kSlotPeriodMs;
-      rx_miss_count_ = 0;
+      // An acknowledgement belongs to the remote we had transmitted
+      // to when it arrived, which the tick may have moved on from.
+      const uint8_t index = options_.ptx ? rx_packet_.tag : 0;
+      const uint16_t updated =
+          remotes_[index].ParsePacket(rx_packet_, rx_cycle);
+      LogRxSlots(index, updated);
     }
-
-    remotes_[last_transmit_remote_index_].ParsePacket(rx_packet_);
   }
 
   void PollMillisecond() {
     MJ_ASSERT(!!nrf_);
+    // The radio's configuration and register verification use
+    // blocking SPI transactions, so they run from the main loop
+    // rather than the tick.
     nrf_->PollMillisecond();
+  }
 
-    slot_timer_--;
+  // Invoked from the deadline timer interrupt.
+  void HandleTick(uint32_t deadline_us) {
+    const uint32_t late_us = timer_->read_us() - deadline_us;
 
-    if (!options_.ptx) {
-      PollMillisecondReceive();
+    stats_.ticks++;
+
+    // If we were held off past the next deadline, run the ticks we
+    // missed back to back so that the frame stays aligned.
+    const uint32_t count = 1 + late_us / kTickUs;
+
+    if (rx_anchored_) {
+      // This deadline was taken from when a packet arrived, not from
+      // the previous tick, so any lateness is just how long Poll took
+      // to read it.  Catching up on that is not an overrun.
+      rx_anchored_ = false;
+      stats_.catch_up_ticks += count - 1;
     } else {
-      PollMillisecondTransmit();
+      stats_.jitter_us = late_us;
+      stats_.max_jitter_us = std::max(stats_.max_jitter_us, late_us);
+      stats_.missed_deadlines += count - 1;
     }
+
+    for (uint32_t i = 0; i < count; i++) {
+      Tick();
+    }
+
+    deadline_timer_.Schedule(deadline_us + count * kTickUs);
   }
 
-  void PollMillisecondTransmit() {
-    // We split up our total slot period into regions based on how
-    // many remotes we have.
-    constexpr int per_slot_count = kSlotPeriodMs / kNumRemotes;
-    const bool final_cycle = (slot_timer_ == 0);
+  void Tick() {
+    MJ_ASSERT(!!nrf_);
 
-    remote_index_ = std::min(kNumRemotes - 1, slot_timer_ / per_slot_count);
-    const int remote_timer = slot_timer_ - remote_index_ * per_slot_count;
+    // Nothing can be done until the radio has finished its power on
+    // configuration.
+    if (!nrf_->ready()) { return; }
+    if (!radio_ready_) {
+      radio_ready_ = true;
+      if (!options_.ptx) { StartSearch(); }
+    }
 
-    auto* remote = &remotes_[remote_index_];
+    slot_timer_--;
 
-    if (remote->enabled()) {
-      if (remote_timer == 0) {
-        last_transmit_remote_index_ = remote_index_;
-        TransmitCycle();
-      } else if (remote_timer == 2) {
-        // Switch to the next remote 2ms before we transmit.
+    if (!options_.ptx) {
+      TickReceive();
+    } else {
+      TickTransmit();
+    }
+  }
+
+  void TickTransmit() {
+    for (int i = 0; i < plan_size_; i++) {
+      const auto& entry = plan_[i];
+      auto* remote = &remotes_[entry.remote_index];
+
+      if (slot_timer_ == entry.tx_tick) {
+        nrf_->SetRxTag(entry.remote_index);
+        TransmitCycle(entry.remote_index, entry.payload_size);
+      } else if (slot_timer_ == entry.tx_tick + kHopLeadTicks) {
+        // Switch to the next remote shortly before we transmit.
+        remote_index_ = entry.remote_index;
         nrf_->SelectId(remote->shockburst_id());
         nrf_->SelectRfChannel(remote->channel(channel_index_));
       }
     }
 
-    if (final_cycle) {
+    if (slot_timer_ == 0) {
       SwitchChannel();
-      slot_timer_ = kSlotPeriodMs;
+      slot_timer_ = period_ticks_;
+      BuildPlan();
     }
   }
 
-  void PollMillisecondReceive() {
+  // Divide the next period between the enabled remotes.  Each gets
+  // one transmission, and the time after it is sized to fit that
+  // remote's packet, the full ack payload and the hop to the next
+  // remote.  Any spare time is shared out evenly.  Disabled remotes
+  // get nothing.
+  //
+  // slot_timer_ counts down, so the first plan entry transmits at the
+  // end of the period and the last one first.
+  void BuildPlan() {
+    int32_t gap_ticks[kMaxRemotes] = {};
+    int32_t total_ticks = 0;
+
+    plan_size_ = 0;
+    for (int i = 0; i < kMaxRemotes; i++) {
+      const auto& remote = remotes_[i];
+      if (!remote.enabled()) { continue; }
+
+      const int payload_size = remote.planned_payload_size();
+      const int32_t window_us =
+          ExchangeUs(options_, payload_size) + kHopLeadTicks * kTickUs;
+      const int32_t ticks = (window_us + kTickUs - 1) / kTickUs;
+
+      plan_[plan_size_].remote_index = i;
+      plan_[plan_size_].payload_size = payload_size;
+      gap_ticks[plan_size_] = ticks;
+      total_ticks += ticks;
+      plan_size_++;
+    }
+
+    if (plan_size_ == 0) { return; }
+
+    if (total_ticks > period_ticks_) {
+      // The period was not validated against this data, so just
+      // split it evenly.  Restart leaves room for the hop lead in
+      // each share, but never let two remotes share a tick.
+      for (int i = 0; i < plan_size_; i++) {
+        gap_ticks[i] = std::max<int32_t>(1, period_ticks_ / plan_size_);
+      }
+    } else {
+      const int32_t spare = (period_ticks_ - total_ticks) / plan_size_;
+      for (int i = 0; i < plan_size_; i++) {
+        gap_ticks[i] += spare;
+      }
+    }
+
+    // The first entry's gap is whatever is left at the start of the
+    // period, which is at least what it asked for.
+    plan_[0].tx_tick = 0;
+    for (int i = 1; i < plan_size_; i++) {
+      plan_[i].tx_tick = plan_[i - 1].tx_tick + gap_ticks[i];
+    }
+  }
+
+  void TickReceive() {
     auto* remote = &remotes_.front();
 
+    if (receive_mode_ == kSearching && search_sweeping_) {
+      TickSweep();
+    }
+
     if (slot_timer_ == 0) {
-      slot_timer_ = kSlotPeriodMs;
+      slot_timer_ = period_ticks_;
       rx_miss_count_++;
 
-      if (receive_mode_ == kSynchronizing) {
-        if (rx_miss_count_ > 20) {
-          // Move on to the next channel.
+      switch (receive_mode_) {
+        case kSearching: {
+          // Alternate periods between the RPD sweep and listening on
+          // a single channel.  The latter still finds transmitters
+          // which are too weak to trip the RPD.
+          search_sweeping_ = !search_sweeping_;
+          if (search_sweeping_) { break; }
+
+          if (rx_miss_count_ > 2 * kSyncDwellPeriods) {
+            // Move on to the next channel.
+            SwitchChannel();
+            rx_miss_count_ = 0;
+          }
+          nrf_->SelectRfChannel(remote->channel(channel_index_));
+          break;
+        }
+        case kAcquiring: {
+          if (rx_miss_count_ >= kAcquireMissLimit) {
+            // That energy was probably something else.
+            stats_.rpd_false_alarms++;
+            StartSearch();
+            break;
+          }
+          // Keep following where the transmitter should be.
           SwitchChannel();
           nrf_->SelectRfChannel(remote->channel(channel_index_));
-          rx_miss_count_ = 0;
+          break;
         }
-      } else {
-        if (rx_miss_count_ > 5) {
-          // Whoops, count us as now needing to synchronize.
-          receive_mode_ = kSynchronizing;
+        case kLocked:
+        case kCoasting: {
+          // The packet is due about now, so whether it was missed is
+          // only judged at the hop, once Poll has had a chance to
+          // read it.
+          break;
         }
       }
-    } else if (slot_timer_ == (kSlotPeriodMs / 2) && receive_mode_ == kLocked) {
-      // When receiving, we switch to the next channel halfway through
-      // our time window.
+    } else if (slot_timer_ == rx_hop_timer_ &&
+               (receive_mode_ == kLocked || receive_mode_ == kCoasting)) {
+      if (!rx_since_hop_) {
+        HandleReceiveMiss();
+        if (receive_mode_ == kSearching) { return; }
+      }
+      rx_since_hop_ = false;
+
+      // When receiving, we switch to the next channel between the
+      // packets, see PlanReceiveHop.
+      remote->UpdateRpd(channel_index_, nrf_->received_power_detected());
       SwitchChannel();
       nrf_->SelectRfChannel(remote->channel(channel_index_));
-      ReplyCycle();
+      // While coasting, there is no point filling the ack FIFO with
+      // payloads which will be stale by the time anyone hears them.
+      if (receive_mode_ == kLocked) {
+        ReplyCycle();
+      }
     }
   }
 
+  // No packet arrived between the previous hop and this one.
+  void HandleReceiveMiss() {
+    auto* remote = &remotes_.front();
+    remote->UpdateQuality(channel_index_, false);
+
+    if (receive_mode_ == kLocked) {
+      if (rx_miss_count_ > lock_loss_count_) {
+        // The transmitter is presumably still hopping on schedule, so
+        // keep following it.
+        receive_mode_ = kCoasting;
+        stats_.coasts++;
+      }
+      return;
+    }
+
+    UpdateLockTime(timer_->read_us());
+
+    // Our clock error grows the longer we coast.  Once it could put a
+    // packet on the far side of either hop, following the sequence no
+    // longer helps.
+    const uint32_t elapsed_us = timer_->read_us() - last_rx_us_;
+    const uint32_t uncertainty_us = static_cast<uint32_t>(
+        static_cast<uint64_t>(elapsed_us) * kClockTolerancePpm /
+        1000000) + kTickUs;
+    stats_.coast_us = elapsed_us;
+    if (elapsed_us > kCoastTimeoutUs ||
+        static_cast<int32_t>(uncertainty_us) > rx_margin_us_) {
+      StartSearch();
+    }
+  }
+
+  void StartSearch() {
+    auto& remote_stats = remotes_.front().mutable_remote_stats();
+    if (receive_mode_ == kLocked || receive_mode_ == kCoasting) {
+      remote_stats.resyncs++;
+    }
+    remote_stats.lock_us = 0;
+
+    receive_mode_ = kSearching;
+    search_sweeping_ = true;
+    search_start_us_ = timer_->read_us();
+    sweep_position_ = channel_index_;
+    rx_miss_count_ = 0;
+    nrf_->SelectRfChannel(remotes_.front().channel(sweep_position_));
+  }
+
+  // Step through the hop sequence, one position per tick, looking for
+  // energy with the RPD.  We have been on the current channel for a
+  // whole tick, which is longer than the 170us the RPD needs.
+  //
+  // The sweep runs backwards, against the transmitter's direction of
+  // travel, so that the two meet as soon as possible.
+  void TickSweep() {
+    auto* remote = &remotes_.front();
+
+    if (nrf_->received_power_detected()) {
+      stats_.rpd_hits++;
+
+      // Assume that was our transmitter, which will be on the next
+      // position in the sequence one period from now.  Allow some
+      // extra time for the first packet, since we don't know where
+      // in the packet we saw the energy.
+      SetPosition(sweep_position_);
+      SwitchChannel();
+      nrf_->SelectRfChannel(remote->channel(channel_index_));
+
+      receive_mode_ = kAcquiring;
+      rx_miss_count_ = 0;
+      slot_timer_ = period_ticks_ + period_ticks_ / 4;
+      return;
+    }
+
+    sweep_position_ = (sweep_position_ + kNumChannels - 1) % kNumChannels;
+    nrf_->SelectRfChannel(remote->channel(sweep_position_));
+  }
+
   Remote* remote(int index) {
     MJ_ASSERT(index >= 0 && index < static_cast<int>(remotes_.size()));
     return &remotes_[index];
@@ -166,6 +531,26 @@ class SlotRfProtocol::Impl {
     return nrf_->error();
   }
 
+  Nrf24l01::Stats nrf_stats() const {
+    return nrf_->stats();
+  }
+
+  Stats stats() const {
+    CriticalSectionLock lock;
+    return stats_;
+  }
+
+  const RxEvent* rx_event(int index) const {
+    if (index < 0 || index >= rx_log_count_) { return nullptr; }
+    return &rx_log_[(rx_log_start_ + index) % kRxLogSize];
+  }
+
+  void ConsumeRxEvents(int count) {
+    count = std::min(count, rx_log_count_);
+    rx_log_start_ = (rx_log_start_ + count) % kRxLogSize;
+    rx_log_count_ -= count;
+  }
+
  private:
   class ConcreteRemote : public Remote {
    public:
@@ -174,7 +559,32 @@ class SlotRfProtocol::Impl {
     }
 
     void tx_slot(int slot_idx, const Slot& slot) override {
+      const auto& old_slot = tx_slots_[slot_idx];
+      const bool reschedule =
+          slot.priority != old_slot.priority || slot.size != old_slot.size ||
+          slot.on_change != old_slot.on_change;
+
+      // Only we write tx_slots_, so the schedule can be compiled
+      // outside of the lock.  It is swapped in together with the new
+      // slot so that the interrupt never sees a plan for the old size.
+      Schedule schedule;
+      if (reschedule) {
+        CompileSchedule(slot_idx, slot, &schedule);
+      }
+
+      // The slots are consumed from the scheduler interrupt.
+      CriticalSectionLock lock;
       tx_slots_[slot_idx] = slot;
+      if (reschedule) {
+        schedule_ = schedule;
+      }
+      const uint16_t bit = 1 << slot_idx;
+      if (slot.on_change && slot.priority != 0) {
+        dirty_mask_ |= bit;
+      } else {
+        dirty_mask_ &= ~bit;
+        in_flight_mask_ &= ~bit;
+      }
     }
 
     const Slot& tx_slot(int slot_idx) const override {
@@ -185,11 +595,47 @@ class SlotRfProtocol::Impl {
       return rx_slots_[slot_idx];
     }
 
+    ChannelStats channel_stats() const override {
+      CriticalSectionLock lock;
+      return channel_stats_;
+    }
+
+    RemoteStats remote_stats() const override {
+      CriticalSectionLock lock;
+      return remote_stats_;
+    }
+
+    RemoteStats& mutable_remote_stats() {
+      return remote_stats_;
+    }
+
+    SlotBulkStream* bulk() override {
+      return &bulk_;
+    }
+
     bool enabled() const {
       return enabled_;
     }
 
+    /// Return the largest packet the current schedule will send,
+    /// allowing for every on change slot going out at once.  While a
+    /// hop change is announced or the bulk stream is busy, the extra
+    /// records can fill the whole payload.
+    int planned_payload_size() const {
+      if ((hop_change_.pending && hop_change_.announce) ||
+          bulk_.tx_pending()) {
+        return Nrf24l01::kMaxPayloadSize;
+      }
+      return std::max<int>(
+          1, std::min<int>(Nrf24l01::kMaxPayloadSize,
+                           schedule_.max_size + schedule_.on_change_size));
+    }
+
     void SetId(uint32_t id) {
+      // Any hop change in progress was for the old sequence.
+      hop_change_ = {};
+      next_spare_ = 0;
+
       enabled_ = id != 0;
       if (!enabled_) { return; }
 
@@ -201,7 +647,7 @@ class SlotRfProtocol::Impl {
       while (channel_count < kNumChannels) {
         prn = (prn * 0x0019660D) + 0x3c6ef35f;
 
-        const uint8_t possible_channel = prn % 125;
+        const uint8_t possible_channel = prn % kMaxRfChannel;
 
         // See if this channel is usable.
         if (!EvaluatePossibleChannel(possible_channel, channel_count)) {
@@ -212,6 +658,27 @@ class SlotRfProtocol::Impl {
         channels_[channel_count] = possible_channel;
         channel_count++;
       }
+
+      // The spares continue the same sequence, but are not subject to
+      // the band limits, which only describe the initial hop set.
+      int spare_count = 0;
+      while (spare_count < kNumSpareChannels) {
+        prn = (prn * 0x0019660D) + 0x3c6ef35f;
+
+        const uint8_t possible_channel = prn % kMaxRfChannel;
+        if (std::count(std::begin(channels_), std::end(channels_),
+                       possible_channel) ||
+            std::count(spares_, spares_ + spare_count, possible_channel)) {
+          continue;
+        }
+        spares_[spare_count] = possible_channel;
+        spare_count++;
+      }
+
+      for (int i = 0; i < kNumChannels; i++) {
+        channel_stats_.channels[i] = {};
+        channel_stats_.channels[i].channel = channels_[i];
+      }
     }
 
     uint64_t shockburst_id() const {
@@ -222,32 +689,119 @@ class SlotRfProtocol::Impl {
       return channels_[index];
     }
 
-    void ParsePacket(const Nrf24l01::Packet& packet) {
+    /// Return the hop position using the given channel, or -1.
+    int find_position(uint8_t channel) const {
+      for (int i = 0; i < kNumChannels; i++) {
+        if (channels_[i] == channel) { return i; }
+      }
+      return -1;
+    }
+
+    /// Record whether the exchange at the given hop position worked.
+    void UpdateQuality(int position, bool success) {
+      auto& quality = channel_stats_.channels[position];
+      quality.attempts++;
+      if (success) { quality.successes++; }
+      if (quality.samples < 0xffff) { quality.samples++; }
+      // An exponential filter with a time constant of 8 samples.  The
+      // step is rounded away from zero, otherwise it would truncate
+      // to nothing short of either end and never reach 0 or 255.
+      const int target = success ? 255 : 0;
+      const int error = target - quality.quality;
+      quality.quality += (error + (error > 0 ? 7 : -7)) / 8;
+
+      if (!success) { remote_stats_.lost++; }
+    }
+
+    void UpdateRpd(int position, bool detected) {
+      auto& quality = channel_stats_.channels[position];
+      quality.rpd_samples++;
+      if (detected) { quality.rpd_hits++; }
+    }
+
+    /// Called by a transmitter just before it transmits to this
+    /// remote on the given hop position.
+    void BeginTransmit(int position) {
+      // Any ack payload for our previous transmission has long since
+      // arrived, so we can account for it now.
+      if (tx_position_ >= 0) {
+        const bool acked = ack_seen_;
+        UpdateQuality(tx_position_, acked);
+        if (acked) { remote_stats_.acked++; }
+        if (!acked && in_flight_mask_) {
+          // The receiver may not have seen these, so send them again.
+          dirty_mask_ |= in_flight_mask_;
+          remote_stats_.change_resends += __builtin_popcount(in_flight_mask_);
+        }
+        in_flight_mask_ = 0;
+        MaybeReplaceChannel(tx_position_);
+      }
+      ack_seen_ = false;
+      tx_position_ = position;
+    }
+
+    /// Called whenever the hop sequence moves into a different cycle,
+    /// which is the only point at which the hop set is changed.  For
+    /// receivers this may also step backwards, when a packet shows
+    /// we had hopped early.
+    void SetCycle(uint32_t cycle) {
+      cycle_ = cycle;
+      if (!hop_change_.pending) { return; }
+
+      const int32_t remaining = hop_change_.apply_cycle - cycle_;
+      if (remaining > 0) { return; }
+
+      ApplyHopChange();
+      if (!hop_change_.announce || remaining <= -kHopChangeLingerCycles) {
+        hop_change_.pending = false;
+      }
+    }
+
+    /// Return a bitmask of the slots which were updated.  @p cycle is
+    /// the hop cycle the packet was sent in.
+    uint16_t ParsePacket(const Nrf24l01::Packet& packet, uint32_t cycle) {
       // Update our receive ages:
       for (auto& slot : rx_slots_) { slot.age++; }
 
+      uint16_t updated = 0;
+
+      if (packet.size > Nrf24l01::kMaxPayloadSize) {
+        remote_stats_.malformed++;
+        return updated;
+      }
+
+      // For a transmitter, anything received is an ack payload.
+      ack_seen_ = true;
+      remote_stats_.received++;
+
       const char* pos = packet.data;
       auto remaining = packet.size;
 
       while (remaining) {
         uint8_t header = static_cast<uint8_t>(*pos);
+        if (header == kPlaceholder && remaining == 1) { break; }
+
         uint8_t slot_index = header >> 4;
         uint8_t slot_size = header & 0x0f;
         remaining--;
         pos++;
         if (slot_size > remaining) {
-          // TODO: Record this as malformed.
-          return;
+          remote_stats_.malformed++;
+          return updated;
         }
 
-        if (slot_index == 15) {
-          // This is reserved for special codes and can only appear at
-          // the end.
-          break;
+        if (slot_index == kRecordSlot) {
+          // This is reserved for extended records, which come after
+          // all the slots.
+          HandleRecord(pos, slot_size, cycle);
+          pos += slot_size;
+          remaining -= slot_size;
+          continue;
         }
 
         auto& slot = rx_slots_[slot_index];
         slot.age = 0;
+        slot.timestamp_us = packet.timestamp_us;
         slot.size = slot_size;
         std::memcpy(slot.data, pos, slot_size);
 
@@ -255,72 +809,291 @@ class SlotRfProtocol::Impl {
         cur_bitfield = (cur_bitfield + 1) % 4;
         slot_bitfield_ = (slot_bitfield_ & ~(0x03 << (slot_index * 2))) |
             (cur_bitfield << (slot_index * 2));
+        remote_stats_.slot_rx_count[slot_index]++;
+        updated |= (1 << slot_index);
 
         pos += slot_size;
         remaining -= slot_size;
       }
+
+      return updated;
     }
 
-    void PrepareTxPacket(Nrf24l01::Packet* packet) {
-      // Increment the ages for all slots.
-      for (auto& slot : tx_slots_) {
-        slot.age++;
-      }
+    /// Fill @p packet, using no more than the @p budget bytes its
+    /// window was planned for.
+    void PrepareTxPacket(Nrf24l01::Packet* packet, uint32_t now_us,
+                         int budget) {
+      remote_stats_.sent++;
+
+      // Everything was decided when the schedule was compiled.
+      const uint16_t mask = schedule_.windows[priority_count_].slot_mask;
+
+      uint8_t record[kMaxSlotSize] = {};
+      int record_size = PrepareRecord(record);
+      // A record which became pending after this window was planned
+      // may not fit.  The next window will be planned with room.
+      if (record_size + 1 > budget) { record_size = 0; }
+      // While a record is pending, slots are dropped to make room.
+      const int max_size = budget - (record_size ? (record_size + 1) : 0);
+      const auto fits = [&](int slot_idx) {
+        return packet->size + tx_slots_[slot_idx].size + 1 <= max_size;
+      };
 
-      // Pick a set of slots to send out.
+      packet->size = 0;
 
-      // For all slots which are enabled for this priority window, fill
-      // our transmission buffer with those with the oldest age.
-      auto enabled_slots = FindEnabledSlots(priority_count_);
-      std::sort(enabled_slots.begin(), enabled_slots.end(),
-                [&](auto lhs, auto rhs) {
-                  return tx_slots_[lhs].age > tx_slots_[rhs].age;
-                });
+      // Updated on change slots go first, then those due a refresh.
+      // Scheduled slots which no longer fit just wait for their next
+      // window.
+      for (int slot_idx = 0; slot_idx < kNumSlots; slot_idx++) {
+        const auto& slot = tx_slots_[slot_idx];
+        if (!slot.on_change || slot.priority == 0) { continue; }
+        const uint16_t bit = 1 << slot_idx;
+        const bool refresh_due =
+            slot.refresh_ms != 0 &&
+            (now_us - last_sent_us_[slot_idx]) >= slot.refresh_ms * 1000;
+        if ((dirty_mask_ & bit) == 0 && !refresh_due) { continue; }
+        if (!fits(slot_idx)) { continue; }
+
+        EmitSlot(packet, slot_idx);
+        dirty_mask_ &= ~bit;
+        in_flight_mask_ |= bit;
+        last_sent_us_[slot_idx] = now_us;
+      }
 
-      packet->size = 0;
-      // Now loop through by age filling up whatever we can.
-      for (auto slot_idx : enabled_slots) {
-        const int remaining_size = 32 - packet->size;
-        if ((tx_slots_[slot_idx].size + 1) < remaining_size) {
-          EmitSlot(packet, slot_idx);
-        }
+      for (int slot_idx = 0; slot_idx < kNumSlots; slot_idx++) {
+        if ((mask & (1 << slot_idx)) == 0) { continue; }
+        if (!fits(slot_idx)) { continue; }
+        EmitSlot(packet, slot_idx);
       }
 
+      if (record_size) {
+        EmitRecord(packet, record, record_size);
+      }
+
+      // The bulk stream gets whatever is left.  Each record costs a
+      // header and a type byte.
+      const auto bulk_space = [&]() {
+        return budget - static_cast<int>(packet->size) - 2;
+      };
+      record[0] = kRecordBulkAck;
+      const int ack_size = bulk_.PrepareAck(&record[1], bulk_space());
+      if (ack_size) { EmitRecord(packet, record, ack_size + 1); }
+
+      record[0] = kRecordBulkData;
+      const int data_size = bulk_.PrepareData(
+          &record[1], std::min<int>(SlotBulkStream::kMaxDataSize,
+                                    std::max(0, bulk_space())));
+      if (data_size) { EmitRecord(packet, record, data_size + 1); }
+
       // The NRF won't send anything if there are no bytes at all.
       // Thus, use a placeholder if that is the case.  We need to send
       // something in order to give the receiver a chance to ack.
       if (packet->size == 0) {
-        packet->data[0] = 0xff;
+        packet->data[0] = kPlaceholder;
         packet->size = 1;
       }
 
-      priority_count_ = (priority_count_ + 1) % 32;
+      priority_count_ = (priority_count_ + 1) % kNumWindows;
     }
 
    private:
-    micro::StaticVector<uint8_t, kNumSlots>
-    FindEnabledSlots(uint8_t current_priority) const {
-      micro::StaticVector<uint8_t, kNumSlots> result;
-      uint32_t mask = 1 << current_priority;
+    /// Fill @p record with any extended record we need to send, and
+    /// return its size, or 0 if there is none.
+    int PrepareRecord(uint8_t* record) const {
+      if (hop_change_.pending && hop_change_.announce) {
+        const int32_t remaining = hop_change_.apply_cycle - cycle_;
+        record[0] = kRecordHopChange;
+        record[1] = hop_change_.position;
+        record[2] = hop_change_.channel;
+        record[3] = std::max<int32_t>(0, remaining);
+        return 4;
+      }
+      return 0;
+    }
+
+    void HandleRecord(const char* data, int size, uint32_t cycle) {
+      if (size < 1) { return; }
+      const auto* record = reinterpret_cast<const uint8_t*>(data);
+
+      switch (record[0]) {
+        case kRecordHopChange: {
+          if (size < 4) { return; }
+          const uint8_t position = record[1];
+          const uint8_t channel = record[2];
+          const uint8_t cycles = record[3];
+          // The radio only has channels 0 to 124, and a channel may
+          // only appear once in the hop sequence, though the same
+          // announcement may be heard again after it was applied.
+          if (position >= kNumChannels || channel >= kMaxRfChannel) {
+            return;
+          }
+          const int existing = find_position(channel);
+          if (existing >= 0 && existing != position) { return; }
+
+          // The hop set is switched from the scheduler interrupt.  The
+          // count is relative to the cycle the packet was sent in.
+          // Hearing it again re-anchors the countdown, and 0 means it
+          // is already in effect.
+          CriticalSectionLock lock;
+          hop_change_.pending = true;
+          hop_change_.announce = false;
+          hop_change_.position = position;
+          hop_change_.channel = channel;
+          hop_change_.apply_cycle = cycle + cycles;
+          SetCycle(cycle_);
+          break;
+        }
+        case kRecordBulkData: {
+          bulk_.HandleData(&record[1], size - 1);
+          break;
+        }
+        case kRecordBulkAck: {
+          bulk_.HandleAck(&record[1], size - 1);
+          break;
+        }
+        default: {
+          // Unknown records are ignored, so that new ones can be added
+          // without breaking older receivers.
+          break;
+        }
+      }
+    }
+
+    void MaybeReplaceChannel(int position) {
+      if (hop_change_.pending) { return; }
+
+      const auto& quality = channel_stats_.channels[position];
+      if (quality.samples < kMinQualitySamples ||
+          quality.quality >= kSwapQuality) {
+        return;
+      }
+
+      // Announce the change for at least one complete cycle before it
+      // takes effect.
+      hop_change_.pending = true;
+      hop_change_.announce = true;
+      hop_change_.position = position;
+      hop_change_.channel = spares_[next_spare_];
+      hop_change_.apply_cycle = cycle_ + 2;
+    }
+
+    void ApplyHopChange() {
+      const int position = hop_change_.position;
+      const uint8_t old_channel = channels_[position];
+      if (old_channel == hop_change_.channel) {
+        // We may hear the same announcement again after applying it.
+        return;
+      }
+
+      channels_[position] = hop_change_.channel;
+
+      // The replaced channel goes to the back of the spares, where it
+      // may get another chance later.
+      spares_[next_spare_] = old_channel;
+      next_spare_ = (next_spare_ + 1) % kNumSpareChannels;
+
+      auto& quality = channel_stats_.channels[position];
+      quality = {};
+      quality.channel = hop_change_.channel;
+      channel_stats_.hop_changes++;
+    }
+
+    /// Each priority is a bitmask over this many transmit windows.
+    static constexpr int kNumWindows = 32;
+
+    struct Schedule {
+      struct Window {
+        uint16_t slot_mask = 0;
+        uint8_t size = 0;
+      };
+      Window windows[kNumWindows] = {};
+      uint8_t max_size = 0;
+      // The space needed to send every enabled on change slot.
+      uint8_t on_change_size = 0;
+    };
+
+    /// Work out which slots go out in each window, as if @p slot were
+    /// stored at @p changed_idx.  On change slots are left out.
+    ///
+    /// For all slots which are enabled in a window, the oldest are
+    /// packed first.  The ages only depend upon the priorities and
+    /// sizes, so we run through all the windows twice to reach the
+    /// steady state and record the second pass.
+    void CompileSchedule(int changed_idx, const Slot& slot,
+                         Schedule* schedule) const {
+      uint32_t priorities[kNumSlots] = {};
+      uint8_t sizes[kNumSlots] = {};
+      int on_change_size = 0;
       for (int i = 0; i < kNumSlots; i++) {
-        if (tx_slots_[i].priority & mask) { result.push_back(i); }
+        const auto& this_slot = (i == changed_idx) ? slot : tx_slots_[i];
+        sizes[i] = this_slot.size;
+        if (this_slot.on_change) {
+          if (this_slot.priority) { on_change_size += this_slot.size + 1; }
+        } else {
+          priorities[i] = this_slot.priority;
+        }
+      }
+
+      uint32_t ages[kNumSlots] = {};
+      for (int pass = 0; pass < 2; pass++) {
+        for (int window = 0; window < kNumWindows; window++) {
+          for (auto& age : ages) { age++; }
+
+          micro::StaticVector<uint8_t, kNumSlots> enabled_slots;
+          for (int i = 0; i < kNumSlots; i++) {
+            if (priorities[i] & (1u << window)) {
+              enabled_slots.push_back(i);
+            }
+          }
+          std::sort(enabled_slots.begin(), enabled_slots.end(),
+                    [&](auto lhs, auto rhs) {
+                      return ages[lhs] > ages[rhs];
+                    });
+
+          auto& entry = schedule->windows[window];
+          entry = {};
+          for (auto slot_idx : enabled_slots) {
+            const int needed = sizes[slot_idx] + 1;
+            if (entry.size + needed <= Nrf24l01::kMaxPayloadSize) {
+              entry.slot_mask |= (1 << slot_idx);
+              entry.size += needed;
+              ages[slot_idx] = 0;
+            }
+          }
+        }
       }
-      return result;
+
+      schedule->max_size = 0;
+      for (const auto& window : schedule->windows) {
+        schedule->max_size = std::max(schedule->max_size, window.size);
+      }
+      schedule->on_change_size =
+          std::min<int>(Nrf24l01::kMaxPayloadSize, on_change_size);
     }
 
     void EmitSlot(Nrf24l01::Packet* packet, int slot_index) {
       auto& size = packet->size;
 
-      const int remaining = 32 - size;
-      auto& slot = tx_slots_[slot_index];
+      const int remaining = Nrf24l01::kMaxPayloadSize - size;
+      const auto& slot = tx_slots_[slot_index];
 
-      MJ_ASSERT((slot.size + 1) < remaining);
+      MJ_ASSERT((slot.size + 1) <= remaining);
 
       packet->data[size] = (slot_index << 4) | slot.size;
       size++;
       std::memcpy(&packet->data[size], slot.data, slot.size);
       size += slot.size;
-      slot.age = 0;
+
+      remote_stats_.slot_tx_count[slot_index]++;
+    }
+
+    void EmitRecord(Nrf24l01::Packet* packet,
+                    const uint8_t* record, int record_size) {
+      MJ_ASSERT(packet->size + record_size + 1 <= Nrf24l01::kMaxPayloadSize);
+
+      packet->data[packet->size++] = (kRecordSlot << 4) | record_size;
+      std::memcpy(&packet->data[packet->size], record, record_size);
+      packet->size += record_size;
     }
 
     bool EvaluatePossibleChannel(uint8_t possible_channel, int channel_count) {
@@ -360,17 +1133,141 @@ class SlotRfProtocol::Impl {
     int priority_count_ = 0;
     uint64_t shockburst_id_ = 0;
     uint8_t channels_[kNumChannels] = {};
+    uint8_t spares_[kNumSpareChannels] = {};
+    uint8_t next_spare_ = 0;
+    ChannelStats channel_stats_;
+    RemoteStats remote_stats_;
+    SlotBulkStream bulk_;
+
+    struct HopChange {
+      bool pending = false;
+      // True if we decided on this change and have to tell the
+      // receiver, false if we were told about it.
+      bool announce = false;
+      uint8_t position = 0;
+      uint8_t channel = 0;
+      // The cycle in which the change takes effect.  Transmitters
+      // keep announcing it until kHopChangeLingerCycles after that.
+      uint32_t apply_cycle = 0;
+    };
+    HopChange hop_change_;
+    // How many times the hop sequence has wrapped, as counted by the
+    // scheduler.
+    uint32_t cycle_ = 0;
+
+    int tx_position_ = -1;
+    volatile bool ack_seen_ = false;
+    // On change slots waiting to be sent, and those in the packet
+    // most recently sent.
+    uint16_t dirty_mask_ = 0;
+    uint16_t in_flight_mask_ = 0;
+    uint32_t last_sent_us_[kNumSlots] = {};
     uint32_t slot_bitfield_ = 0;
     Slot tx_slots_[kNumSlots] = {};
+    Schedule schedule_;
     Slot rx_slots_[kNumSlots] = {};
   };
 
+  void LogRxSlots(int remote_index, uint16_t slot_mask) {
+    if (!slot_mask) { return; }
+    rx_log_packet_++;
+
+    auto& remote = remotes_[remote_index];
+    for (int slot_idx = 0; slot_idx < kNumSlots; slot_idx++) {
+      if ((slot_mask & (1 << slot_idx)) == 0) { continue; }
+
+      const auto& slot = remote.rx_slot(slot_idx);
+      const auto fill = [&](RxEvent* event) {
+        event->size = slot.size;
+        std::memcpy(event->data, slot.data, slot.size);
+        event->seq = remote.mutable_remote_stats().slot_rx_count[slot_idx];
+      };
+
+      if (rx_log_count_ == kRxLogSize) {
+        // Rather than lose some other slot, replace the newest update
+        // to this one still waiting, if there is one.  It keeps its
+        // place, and so its timestamp.
+        RxEvent* const pending = FindRxEvent(remote_index, slot_idx);
+        if (pending) {
+          fill(pending);
+          stats_.rx_events_coalesced++;
+          continue;
+        }
+
+        ConsumeRxEvents(1);
+        stats_.rx_events_dropped++;
+      }
+
+      auto& event = rx_log_[(rx_log_start_ + rx_log_count_) % kRxLogSize];
+      event.remote = remote_index;
+      event.slot = slot_idx;
+      event.timestamp_us = slot.timestamp_us;
+      event.packet = rx_log_packet_;
+      fill(&event);
+      rx_log_count_++;
+    }
+  }
+
+  RxEvent* FindRxEvent(int remote_index, int slot_idx) {
+    for (int i = rx_log_count_ - 1; i >= 0; i--) {
+      auto& event = rx_log_[(rx_log_start_ + i) % kRxLogSize];
+      if (event.remote == remote_index && event.slot == slot_idx) {
+        return &event;
+      }
+    }
+    return nullptr;
+  }
+
+  void UpdateLockTime(uint32_t now_us) {
+    auto& remote_stats = remotes_.front().mutable_remote_stats();
+    remote_stats.lock_us = now_us - lock_start_us_;
+    remote_stats.max_lock_us =
+        std::max(remote_stats.max_lock_us, remote_stats.lock_us);
+  }
+
   void SwitchChannel() {
     channel_index_ = (channel_index_ + 1) % kNumChannels;
+    if (channel_index_ == 0) {
+      cycle_++;
+      UpdateCycle();
+    }
   }
 
-  void TransmitCycle() {
-    remotes_[remote_index_].PrepareTxPacket(&tx_packet_);
+  // Move to @p position by the shortest route, keeping count of any
+  // wrap forward or back, so that both ends agree on cycle
+  // boundaries even when a packet shows we hopped early or late.
+  void SetPosition(int position) {
+    int delta = position - channel_index_;
+    if (delta > kNumChannels / 2) {
+      delta -= kNumChannels;
+    } else if (delta < -kNumChannels / 2) {
+      delta += kNumChannels;
+    }
+    const int target = channel_index_ + delta;
+    channel_index_ = position;
+    if (target >= kNumChannels) {
+      cycle_++;
+      UpdateCycle();
+    } else if (target < 0) {
+      cycle_--;
+      UpdateCycle();
+    }
+  }
+
+  void UpdateCycle() {
+    for (auto& remote : remotes_) { remote.SetCycle(cycle_); }
+  }
+
+  void PrepareTxPacket(int remote_index, int budget) {
+    const uint32_t start_us = timer_->read_us();
+    remotes_[remote_index].PrepareTxPacket(&tx_packet_, start_us, budget);
+    stats_.prepare_us = timer_->read_us() - start_us;
+    stats_.max_prepare_us = std::max(stats_.max_prepare_us, stats_.prepare_us);
+  }
+
+  void TransmitCycle(int remote_index, int payload_size) {
+    remotes_[remote_index].BeginTransmit(channel_index_);
+    PrepareTxPacket(remote_index, payload_size);
 
     // Now we send out our frame, whether or not it has anything in it
     // (that gives the receiver a chance to reply).
@@ -378,16 +1275,37 @@ class SlotRfProtocol::Impl {
   }
 
   void ReplyCycle() {
-    remotes_[remote_index_].PrepareTxPacket(&tx_packet_);
+    // Every exchange already allows for a full ack payload.
+    PrepareTxPacket(remote_index_, Nrf24l01::kMaxPayloadSize);
     nrf_->QueueAck(&tx_packet_);
   }
 
   void Restart() {
+    deadline_timer_.Stop();
+
+    // Callers are expected to check ValidateSlotPeriod, but always
+    // leave room for the hop lead in each enabled remote's window,
+    // and in each half of a receiver's period.
+    const int enabled = std::count_if(
+        options_.ids.begin(), options_.ids.end(),
+        [](auto id) { return id != 0; });
+    period_ticks_ = std::max<int>(
+        std::max(2, enabled) * (kHopLeadTicks + 1),
+        options_.slot_period_us / kTickUs);
+    slot_timer_ = period_ticks_;
+    const auto rx_hop = PlanReceiveHop(options_, period_ticks_ * kTickUs);
+    rx_hop_timer_ = period_ticks_ -
+        std::min<int>(rx_hop.ticks, period_ticks_ - 1);
+    rx_margin_us_ = rx_hop.margin_us;
+    lock_loss_count_ = std::max<int>(
+        kMinLockLoss, kLockLossUs / options_.slot_period_us);
+
     MJ_ASSERT(options_.ids.size() == remotes_.size());
     for (size_t i = 0; i < remotes_.size(); i++) {
       remotes_[i].SetId(options_.ids[i]);
     }
     remote_index_ = 0;
+    BuildPlan();
 
     nrf_.emplace(
         timer_,
@@ -402,7 +1320,7 @@ class SlotRfProtocol::Impl {
           options.enable_crc = true;
           options.crc_length = 2;
           options.auto_retransmit_count = options_.auto_retransmit_count;
-          options.auto_retransmit_delay_us = 1000;
+          options.auto_retransmit_delay_us = kAutoRetransmitDelayUs;
           options.automatic_acknowledgment = true;
           options.initial_channel = 0;
           options.data_rate = options_.data_rate;
@@ -411,6 +1329,7 @@ class SlotRfProtocol::Impl {
           return options;
         }());
 
+    deadline_timer_.Schedule(timer_->read_us() + kTickUs);
   }
 
   const Options options_;
@@ -418,28 +1337,102 @@ class SlotRfProtocol::Impl {
 
   std::optional<Nrf24l01> nrf_;
 
-  std::array<ConcreteRemote, kNumRemotes> remotes_;
+  // This is declared after nrf_ so that it is stopped before the
+  // driver is destroyed.
+  Stm32G4DeadlineTimer deadline_timer_;
+  Stats stats_;
+
+  std::array<ConcreteRemote, kMaxRemotes> remotes_;
+
+  struct PlanEntry {
+    uint8_t remote_index = 0;
+    // The value of slot_timer_ at which to transmit.
+    int tx_tick = 0;
+    // The largest packet the window was sized for.
+    int payload_size = 0;
+  };
+  PlanEntry plan_[kMaxRemotes] = {};
+  int plan_size_ = 0;
+
   uint8_t channel_index_ = 0;
+  uint32_t cycle_ = 0;
   uint8_t remote_index_ = 0;
-  uint8_t last_transmit_remote_index_ = 0;
 
   /// For transmitters, this is the canonical source of the system
   /// time.  For receivers, we attempt to synchronize this to
   /// transmitters.
-  int slot_timer_ = kSlotPeriodMs;
+  int slot_timer_ = 0;
+  int period_ticks_ = 0;
+  // The value of slot_timer_ at which a receiver hops, and how far
+  // from where it is expected a packet can still be heard.
+  int rx_hop_timer_ = 0;
+  int32_t rx_margin_us_ = 0;
+  int lock_loss_count_ = kMinLockLoss;
   uint32_t rx_miss_count_ = 0;
+  // Set by Poll when a receiver hears a packet, and cleared at each
+  // hop.
+  bool rx_since_hop_ = false;
+  // Set by Poll when it schedules the next tick from a packet's
+  // arrival time.
+  bool rx_anchored_ = false;
 
   Nrf24l01::Packet rx_packet_;
   Nrf24l01::Packet tx_packet_;
 
+  RxEvent rx_log_[kRxLogSize] = {};
+  int rx_log_start_ = 0;
+  int rx_log_count_ = 0;
+  uint32_t rx_log_packet_ = 0;
+
   enum ReceiveMode {
-    kSynchronizing,
+    // Looking for the transmitter anywhere in the hop sequence.
+    kSearching,
+    // The RPD saw something, and we are following the hop sequence
+    // from there waiting for the first packet.
+    kAcquiring,
     kLocked,
+    // Packets have stopped arriving, but we keep hopping on our own
+    // time in the expectation that they will resume.
+    kCoasting,
   };
 
-  ReceiveMode receive_mode_ = kSynchronizing;
+  ReceiveMode receive_mode_ = kSearching;
+  bool radio_ready_ = false;
+  bool search_sweeping_ = true;
+  uint8_t sweep_position_ = 0;
+  uint32_t search_start_us_ = 0;
+  uint32_t last_rx_us_ = 0;
+  uint32_t lock_start_us_ = 0;
 };
 
+bool SlotRfProtocol::ValidateSlotPeriod(const Options& options) {
+  if (options.data_rate <= 0 || options.auto_retransmit_count < 0) {
+    return false;
+  }
+
+  if (options.slot_period_us <= 0 ||
+      (options.slot_period_us % kTickUs) != 0) {
+    return false;
+  }
+
+  const int32_t exchange_us = MaxExchangeUs(options);
+  if (options.ptx) {
+    // Every enabled remote needs room for a maximum size exchange and
+    // the hop to the next remote, in whole ticks.
+    const int enabled = std::count_if(
+        options.ids.begin(), options.ids.end(),
+        [](auto id) { return id != 0; });
+    const int32_t window_ticks =
+        (exchange_us + kHopLeadTicks * kTickUs + kTickUs - 1) / kTickUs;
+    return (options.slot_period_us / kTickUs) >= enabled * window_ticks;
+  } else {
+    // Receivers hop between packets, and need to tolerate at least a
+    // tick of timing error either side.
+    return PlanReceiveHop(options, options.slot_period_us).margin_us >=
+        kTickUs;
+  }
+}
+
 SlotRfProtocol::SlotRfProtocol(MillisecondTimer* timer,
                                const Options& options)
     : impl_(timer, options) {}
@@ -470,4 +1463,20 @@ uint32_t SlotRfProtocol::error() const {
   return impl_->error();
 }
 
+Nrf24l01::Stats SlotRfProtocol::nrf_stats() const {
+  return impl_->nrf_stats();
+}
+
+SlotRfProtocol::Stats SlotRfProtocol::stats() const {
+  return impl_->stats();
+}
+
+const SlotRfProtocol::RxEvent* SlotRfProtocol::rx_event(int index) const {
+  return impl_->rx_event(index);
+}
+
+void SlotRfProtocol::ConsumeRxEvents(int count) {
+  impl_->ConsumeRxEvents(count);
+}
+
 }
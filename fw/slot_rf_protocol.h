@@ -14,47 +14,170 @@
 
 #pragma once
 
+#include <array>
+
+#include "mjlib/base/visitor.h"
 #include "mjlib/micro/persistent_config.h"
 #include "mjlib/micro/static_ptr.h"
 
 #include "fw/millisecond_timer.h"
 #include "fw/nrf24l01.h"
+#include "fw/slot_bulk_stream.h"
 
 namespace fw {
 
 class SlotRfProtocol {
  public:
   static constexpr int kNumSlots = 15;
-  static constexpr int kNumRemotes = 2;
+  static constexpr int kMaxRemotes = 8;
+  /// The number of channels in each remote's hop sequence.
+  static constexpr int kNumChannels = 23;
 
   struct Options {
     bool ptx = true;
     /// 0 is reserved to mean that the particular ID is disabled.  In
-    /// receive mode, only id1 is used.
-    std::array<uint32_t, kNumRemotes> ids = {
+    /// receive mode, only the first is used.  Disabled remotes are
+    /// given no air time.
+    std::array<uint32_t, kMaxRemotes> ids = {
       0x3045,
-      0,
     };
     int32_t data_rate = 1000000;
     int32_t output_power = 0;
     int32_t auto_retransmit_count = 0;
 
+    /// The time taken to visit every enabled remote once.  This must
+    /// be a multiple of 250us and leave each enabled remote enough
+    /// time for a full packet and ack, see ValidateSlotPeriod.
+    int32_t slot_period_us = 20000;
+
     Nrf24l01::Pins pins;
   };
 
+  /// Return true if options.slot_period_us is usable with the given
+  /// data rate and retransmit count.
+  static bool ValidateSlotPeriod(const Options&);
+
   SlotRfProtocol(MillisecondTimer*,
                  const Options& options);
   ~SlotRfProtocol();
 
+  /// Process received packets.  The transmit and hop schedule itself
+  /// runs from a timer interrupt.
   void Poll();
+
+  /// Run the radio's power on configuration and register
+  /// verification, which need blocking SPI transactions and so are
+  /// kept out of the timer interrupt.
   void PollMillisecond();
   void Start();
 
+  /// The slot header stores the size in 4 bits.
+  static constexpr int kMaxSlotSize = 15;
+
   struct Slot {
     uint32_t priority = 0;
     uint8_t size = 0;
     uint32_t age = 0;
     uint8_t data[16] = {};
+
+    /// For received slots, when the packet carrying it arrived, as
+    /// captured from the IRQ in MillisecondTimer::read_us() time.
+    uint32_t timestamp_us = 0;
+
+    /// When set, the slot is left out of the priority schedule and
+    /// any non-zero priority just enables it.  It is then sent as
+    /// soon as possible after each update, ahead of the scheduled
+    /// slots, and again every refresh_ms so that a peer which missed
+    /// it catches up eventually.  A refresh_ms of 0 disables the
+    /// refresh.
+    bool on_change = false;
+    uint32_t refresh_ms = 0;
+  };
+
+  /// Link counters for one remote.
+  struct RemoteStats {
+    /// Packets prepared for this remote.  For receivers, these are
+    /// ack payloads.
+    uint32_t sent = 0;
+    /// Transmitters only, packets for which an ack payload came back.
+    uint32_t acked = 0;
+    /// For transmitters, packets which got no ack payload.  For
+    /// receivers, periods in which the expected packet did not arrive
+    /// while synchronized.
+    uint32_t lost = 0;
+    uint32_t received = 0;
+    /// Received packets which could not be parsed.
+    uint32_t malformed = 0;
+
+    /// Receivers only.  The number of times synchronization was lost
+    /// and a new search started, how long the current lock has lasted
+    /// (0 while searching), and the longest lock.
+    uint32_t resyncs = 0;
+    uint32_t lock_us = 0;
+    uint32_t max_lock_us = 0;
+
+    /// The number of packets each slot has been sent in.  Differencing
+    /// these over time gives the effective update rate of each slot.
+    std::array<uint32_t, kNumSlots> slot_tx_count = {};
+    /// The number of times each slot has been received.
+    std::array<uint32_t, kNumSlots> slot_rx_count = {};
+    /// On change slots which were sent again because the packet
+    /// carrying them was not acknowledged.
+    uint32_t change_resends = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(sent));
+      a->Visit(MJ_NVP(acked));
+      a->Visit(MJ_NVP(lost));
+      a->Visit(MJ_NVP(received));
+      a->Visit(MJ_NVP(malformed));
+      a->Visit(MJ_NVP(resyncs));
+      a->Visit(MJ_NVP(lock_us));
+      a->Visit(MJ_NVP(max_lock_us));
+      a->Visit(MJ_NVP(slot_tx_count));
+      a->Visit(MJ_NVP(slot_rx_count));
+      a->Visit(MJ_NVP(change_resends));
+    }
+  };
+
+  /// Link quality for one position in a remote's hop sequence.
+  struct ChannelQuality {
+    /// The RF channel currently used at this position.
+    uint8_t channel = 0;
+    /// An exponentially weighted success rate, 255 is no loss.
+    uint8_t quality = 255;
+    uint16_t samples = 0;
+    uint32_t attempts = 0;
+    uint32_t successes = 0;
+    /// Receivers only.  The RPD is sampled once per visit, just
+    /// before hopping away, and rpd_hits / rpd_samples gives the rate
+    /// at which a signal above -64dBm was present.
+    uint32_t rpd_samples = 0;
+    uint32_t rpd_hits = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(channel));
+      a->Visit(MJ_NVP(quality));
+      a->Visit(MJ_NVP(samples));
+      a->Visit(MJ_NVP(attempts));
+      a->Visit(MJ_NVP(successes));
+      a->Visit(MJ_NVP(rpd_samples));
+      a->Visit(MJ_NVP(rpd_hits));
+    }
+  };
+
+  struct ChannelStats {
+    std::array<ChannelQuality, kNumChannels> channels;
+    /// The number of times a channel was replaced with a spare.
+    uint32_t hop_changes = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(channels));
+      a->Visit(MJ_NVP(hop_changes));
+    }
   };
 
   class Remote {
@@ -74,6 +197,20 @@ class SlotRfProtocol {
 
     /// Return the current value of the given receive slot.
     virtual const Slot& rx_slot(int slot_idx) const = 0;
+
+    /// Return the link quality for each position in the hop sequence.
+    /// Transmitters count a packet as successful if an ack payload
+    /// came back, receivers if the packet arrived.
+    ///
+    /// These are updated from the timer interrupt, so each returns a
+    /// consistent copy.
+    virtual ChannelStats channel_stats() const = 0;
+
+    virtual RemoteStats remote_stats() const = 0;
+
+    /// The bulk byte stream to this remote, which is sent in any
+    /// space the slots leave over.
+    virtual SlotBulkStream* bulk() = 0;
   };
 
   // Return one of the possible remotes.  When in receive mode, only
@@ -86,9 +223,114 @@ class SlotRfProtocol {
   /// Return any error flags.
   uint32_t error() const;
 
+  /// Return statistics from the radio driver.
+  Nrf24l01::Stats nrf_stats() const;
+
+  /// Every received slot is also recorded in a log, so that a
+  /// consumer which falls behind still sees each update.
+  static constexpr int kRxLogSize = 32;
+
+  struct RxEvent {
+    uint8_t remote = 0;
+    uint8_t slot = 0;
+    uint8_t size = 0;
+    uint8_t data[kMaxSlotSize] = {};
+    /// The slot's receive count, see RemoteStats::slot_rx_count,
+    /// including this update.
+    uint32_t seq = 0;
+    /// When the packet carrying it arrived.
+    uint32_t timestamp_us = 0;
+    /// Counts received packets.  All events from one packet, and only
+    /// those, share a value, even when several packets arrive with
+    /// the same timestamp.
+    uint32_t packet = 0;
+  };
+
+  /// Return the @p index oldest unconsumed event, or nullptr if there
+  /// are not that many.  When the log is full, a new update replaces
+  /// the newest one still logged for the same slot, counted in
+  /// Stats::rx_events_coalesced.  If there is none, the oldest event
+  /// is discarded and counted in Stats::rx_events_dropped.
+  const RxEvent* rx_event(int index = 0) const;
+
+  /// Discard the @p count oldest events.
+  void ConsumeRxEvents(int count);
+
+  struct Stats {
+    /// The number of scheduler ticks run, including those run late.
+    uint32_t ticks = 0;
+
+    /// Ticks which were not started until after the following tick
+    /// was due.  These are run back to back to catch up.
+    uint32_t missed_deadlines = 0;
+
+    /// Ticks run back to back after a receiver scheduled its next
+    /// tick from when a packet arrived, because Poll read the packet
+    /// late.  These are not counted in missed_deadlines.
+    uint32_t catch_up_ticks = 0;
+
+    /// How long after its deadline the most recent tick started, and
+    /// the worst case seen.
+    uint32_t jitter_us = 0;
+    uint32_t max_jitter_us = 0;
+
+    /// How long it took to build the most recent outgoing packet, and
+    /// the worst case seen.
+    uint32_t prepare_us = 0;
+    uint32_t max_prepare_us = 0;
+
+    /// For receivers, the number of times lock was acquired, and how
+    /// long it took from starting to search, most recent and worst.
+    uint32_t acquisitions = 0;
+    uint32_t time_to_lock_us = 0;
+    uint32_t max_time_to_lock_us = 0;
+
+    /// Receiver RPD sweep results, and how many of those turned out
+    /// not to lead to a packet.
+    uint32_t rpd_hits = 0;
+    uint32_t rpd_false_alarms = 0;
+
+    /// For receivers, the number of times packets stopped long enough
+    /// to start coasting, how many of those recovered without a full
+    /// search, and how long the latest coast had lasted.
+    uint32_t coasts = 0;
+    uint32_t coast_recoveries = 0;
+    uint32_t coast_us = 0;
+
+    /// Received slot updates pushed out of the log before they were
+    /// consumed, and those which replaced an older update to the same
+    /// slot because the log was full.
+    uint32_t rx_events_dropped = 0;
+    uint32_t rx_events_coalesced = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(ticks));
+      a->Visit(MJ_NVP(missed_deadlines));
+      a->Visit(MJ_NVP(catch_up_ticks));
+      a->Visit(MJ_NVP(jitter_us));
+      a->Visit(MJ_NVP(max_jitter_us));
+      a->Visit(MJ_NVP(prepare_us));
+      a->Visit(MJ_NVP(max_prepare_us));
+      a->Visit(MJ_NVP(acquisitions));
+      a->Visit(MJ_NVP(time_to_lock_us));
+      a->Visit(MJ_NVP(max_time_to_lock_us));
+      a->Visit(MJ_NVP(rpd_hits));
+      a->Visit(MJ_NVP(rpd_false_alarms));
+      a->Visit(MJ_NVP(coasts));
+      a->Visit(MJ_NVP(coast_recoveries));
+      a->Visit(MJ_NVP(coast_us));
+      a->Visit(MJ_NVP(rx_events_dropped));
+      a->Visit(MJ_NVP(rx_events_coalesced));
+    }
+  };
+
+  /// Return statistics about the slot scheduler.
+  Stats stats() const;
+
  private:
   class Impl;
-  mjlib::micro::StaticPtr<Impl, 2048+256> impl_;
+  mjlib::micro::StaticPtr<Impl, 27648> impl_;
 };
 
 }
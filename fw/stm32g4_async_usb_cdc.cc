@@ -14,6 +14,8 @@
 
 #include "fw/stm32g4_async_usb_cdc.h"
 
+#include <algorithm>
+
 #include "usb.h"
 #include "usb_cdc.h"
 
@@ -191,6 +193,7 @@ class Stm32G4AsyncUsbCdc::Impl {
     usbd_reg_config(&udev_, &Impl::g_cdc_setconf);
     usbd_reg_control(&udev_, &Impl::g_cdc_control);
     usbd_reg_descr(&udev_, &Impl::g_cdc_getdesc);
+    usbd_reg_event(&udev_, usbd_evt_sof, &Impl::g_cdc_sof);
 
     usbd_enable(&udev_, true);
     usbd_connect(&udev_, true);
@@ -198,6 +201,7 @@ class Stm32G4AsyncUsbCdc::Impl {
 
   void Poll() {
     usbd_poll(&udev_);
+    ProcessWrite();
   }
 
 /*
@@ -220,9 +224,32 @@ class Stm32G4AsyncUsbCdc::Impl {
                       const micro::SizeCallback& callback) {
     MJ_ASSERT(!current_write_callback_);
 
+    // This is satisfied from Poll, once there is room in the ring.
     current_write_callback_ = callback;
     current_write_data_ = data;
-    current_write_size_ = data.size();
+  }
+
+  void ProcessWrite() {
+    if (!current_write_callback_) { return; }
+
+    const auto to_copy = std::min<int>(
+        current_write_data_.size(), sizeof(tx_ring_) - tx_count_);
+    if (to_copy == 0) {
+      stats_.tx_ring_waits++;
+      return;
+    }
+
+    for (int i = 0; i < to_copy; i++) {
+      tx_ring_[(tx_start_ + tx_count_ + i) % sizeof(tx_ring_)] =
+          current_write_data_[i];
+    }
+    tx_count_ += to_copy;
+    stats_.tx_ring_peak = std::max<uint32_t>(stats_.tx_ring_peak, tx_count_);
+
+    auto copy = current_write_callback_;
+    current_write_callback_ = {};
+    current_write_data_ = {};
+    copy(micro::error_code(), to_copy);
   }
 
   usbd_respond cdc_setconf(uint8_t cfg) {
@@ -237,12 +264,18 @@ class Stm32G4AsyncUsbCdc::Impl {
         return usbd_ack;
     case 1:
         /* configuring device */
-        usbd_ep_config(&udev_, CDC_RXD_EP, USB_EPTYPE_BULK /*| USB_EPTYPE_DBLBUF*/, CDC_DATA_SZ);
-        usbd_ep_config(&udev_, CDC_TXD_EP, USB_EPTYPE_BULK /*| USB_EPTYPE_DBLBUF*/, CDC_DATA_SZ);
+        // The OUT endpoint is single buffered, so that the hardware
+        // NAKs the host after each packet until we read it.  The IN
+        // endpoint is too, as the devfs driver only accepts a double
+        // buffered write once both buffers are free, which gains
+        // nothing.  The next packet is instead kept ready in tx_ring_.
+        usbd_ep_config(&udev_, CDC_RXD_EP, USB_EPTYPE_BULK, CDC_DATA_SZ);
+        usbd_ep_config(&udev_, CDC_TXD_EP, USB_EPTYPE_BULK, CDC_DATA_SZ);
         usbd_ep_config(&udev_, CDC_NTF_EP, USB_EPTYPE_INTERRUPT, CDC_NTF_SZ);
         usbd_reg_endpoint(&udev_, CDC_RXD_EP, g_cdc_rxonly);
         usbd_reg_endpoint(&udev_, CDC_TXD_EP, g_cdc_txonly);
         usbd_ep_write(&udev_, CDC_TXD_EP, 0, 0);
+        rx_pending_ = false;
         return usbd_ack;
     default:
         return usbd_fail;
@@ -302,57 +335,119 @@ class Stm32G4AsyncUsbCdc::Impl {
   }
 
   void cdc_rxonly(uint8_t event, uint8_t ep) {
-    // We always want to read the full amount from the endpoint.
-    const auto bytes_to_read = std::min<int>(CDC_DATA_SZ, sizeof(fifo_) - fpos_);
-    const auto actual = usbd_ep_read(&udev_, ep, &fifo_[fpos_], bytes_to_read);
-    fpos_ += actual;
+    rx_pending_ = true;
+    ReadEndpoint();
 
     //led_com_.write(1);
 
     ProcessRead();
   }
 
+  void ReadEndpoint() {
+    if (!rx_pending_) { return; }
+
+    // Until the packet is read, the endpoint NAKs the host, so leave
+    // it there until all of it is sure to fit.
+    if (kRxSize - (rx_head_ - rx_tail_) < CDC_DATA_SZ) {
+      stats_.rx_holds++;
+      return;
+    }
+    rx_pending_ = false;
+
+    // We always want to read the full amount from the endpoint.
+    const auto actual =
+        usbd_ep_read(&udev_, CDC_RXD_EP, rx_packet_, CDC_DATA_SZ);
+    if (actual <= 0) { return; }
+
+    const uint32_t head = rx_head_;
+    const auto to_copy = std::min<int>(actual, kRxSize - (head - rx_tail_));
+    stats_.rx_overrun_bytes += actual - to_copy;
+    for (int i = 0; i < to_copy; i++) {
+      rx_ring_[(head + i) & kRxMask] = rx_packet_[i];
+    }
+    rx_head_ = head + to_copy;
+    stats_.rx_bytes += to_copy;
+    stats_.rx_ring_fill = rx_head_ - rx_tail_;
+    stats_.rx_ring_peak =
+        std::max(stats_.rx_ring_peak, stats_.rx_ring_fill);
+  }
+
   void ProcessRead() {
-    if (fpos_ == 0) { return; }
     if (!current_read_callback_) { return; }
 
+    const auto regions = Peek(rx_head_ - rx_tail_);
+    if (regions.size() == 0) { return; }
+
     auto copy = current_read_callback_;
-    const auto bytes_to_read = std::min<int>(fpos_, current_read_data_.size());
-    std::memcpy(current_read_data_.data(), fifo_, bytes_to_read);
-    std::memmove(&fifo_[0], &fifo_[bytes_to_read], fpos_ - bytes_to_read);
-    fpos_ -= bytes_to_read;
+    const std::size_t capacity = current_read_data_.size();
+    const auto first = std::min(regions.first.size(), capacity);
+    const auto second = std::min(regions.second.size(), capacity - first);
+    std::memcpy(current_read_data_.data(), regions.first.data(), first);
+    std::memcpy(current_read_data_.data() + first,
+                regions.second.data(), second);
+    Consume(first + second);
 
     current_read_callback_ = {};
     current_read_data_ = {};
 
-    copy(micro::error_code(), bytes_to_read);
+    copy(micro::error_code(), first + second);
+  }
+
+  // Received data, split in two where it wraps around the end of the
+  // receive ring.
+  struct ReadRegions {
+    std::string_view first;
+    std::string_view second;
+
+    std::size_t size() const { return first.size() + second.size(); }
+  };
+
+  ReadRegions Peek(uint32_t size) const {
+    const uint32_t start = rx_tail_ & kRxMask;
+    const uint32_t first = std::min<uint32_t>(size, kRxSize - start);
+    const char* const ring = reinterpret_cast<const char*>(rx_ring_);
+    return ReadRegions{
+      std::string_view(ring + start, first),
+      std::string_view(ring, size - first),
+    };
+  }
+
+  void Consume(std::size_t size) {
+    MJ_ASSERT(size <= rx_head_ - rx_tail_);
+    rx_tail_ = rx_tail_ + size;
+    stats_.rx_ring_fill = rx_head_ - rx_tail_;
+
+    // A packet may have been held back waiting for this room.
+    ReadEndpoint();
   }
 
   void cdc_txonly(uint8_t event, uint8_t ep) {
-    if (!current_write_callback_) {
-      // Write nothing.
-      usbd_ep_write(&udev_, ep, fifo_, 0);
+    if (tx_count_ == 0) {
+      // Write nothing.  This keeps the endpoint going, and terminates
+      // any transfer which ended on a full packet.
+      usbd_ep_write(&udev_, ep, tx_packet_, 0);
       return;
     }
 
     //led_com_.write(1);
 
-    const auto to_write = std::min<int>(current_write_data_.size(), CDC_DATA_SZ);
-
-    usbd_ep_write(&udev_, ep, const_cast<void*>(reinterpret_cast<const void*>(
-                                                    current_write_data_.data())),
-                  to_write);
-    current_write_data_ = std::string_view(
-        current_write_data_.data() + to_write,
-        current_write_data_.size() - to_write);
-    if (current_write_data_.size() == 0) {
-      auto copy = current_write_callback_;
-      current_write_callback_ = {};
-      current_write_data_ = {};
-      copy(micro::error_code(), current_write_size_);
+    // Always send full packets when there is enough queued, even if
+    // that spans the end of the ring.
+    const auto to_write = std::min<int>(tx_count_, CDC_DATA_SZ);
+    for (int i = 0; i < to_write; i++) {
+      tx_packet_[i] = tx_ring_[(tx_start_ + i) % sizeof(tx_ring_)];
     }
+
+    if (usbd_ep_write(&udev_, ep, tx_packet_, to_write) < 0) { return; }
+
+    tx_start_ = (tx_start_ + to_write) % sizeof(tx_ring_);
+    tx_count_ -= to_write;
+    stats_.tx_bytes += to_write;
+    stats_.tx_packets++;
   }
 
+  const Stats& stats() const { return stats_; }
+
   static usbd_respond g_cdc_setconf (usbd_device *dev, uint8_t cfg) {
     return g_impl->cdc_setconf(cfg);
   }
@@ -373,11 +468,30 @@ class Stm32G4AsyncUsbCdc::Impl {
     g_impl->cdc_txonly(event, ep);
   }
 
+  static void g_cdc_sof(usbd_device* dev, uint8_t event, uint8_t ep) {
+    g_impl->frame_count_++;
+  }
+
+  uint32_t frame_count() const { return frame_count_; }
+
 private:
   usbd_device udev_ = {};
   uint32_t ubuf_[0x20] = {};
-  uint8_t fifo_[0x200] = {};
-  uint32_t fpos_ = 0;
+
+  // Received data waiting for a reader.  usbd_poll invokes
+  // cdc_rxonly from Poll, so the ring is only ever touched from the
+  // main loop.  ReadEndpoint advances the head and Consume the tail.
+  // Both count up forever and are masked on use.
+  static constexpr uint32_t kRxSize = 0x200;
+  static constexpr uint32_t kRxMask = kRxSize - 1;
+  uint8_t rx_ring_[kRxSize] = {};
+  uint32_t rx_head_ = 0;
+  uint32_t rx_tail_ = 0;
+  uint8_t rx_packet_[CDC_DATA_SZ] = {};
+  // True when a packet is waiting in the OUT endpoint.
+  bool rx_pending_ = false;
+
+  uint32_t frame_count_ = 0;
 
   struct usb_cdc_line_coding cdc_line_ = {
     .dwDTERate          = 115200,
@@ -388,7 +502,16 @@ private:
 
   micro::SizeCallback current_write_callback_;
   std::string_view current_write_data_;
-  ssize_t current_write_size_ = {};
+
+  // Data waiting to go out the IN endpoint.  Writes complete as soon
+  // as they are copied in here, so the application can get on with
+  // the next one while the USB drains this.
+  uint8_t tx_ring_[0x400] = {};
+  uint32_t tx_start_ = 0;
+  uint32_t tx_count_ = 0;
+  uint8_t tx_packet_[CDC_DATA_SZ] = {};
+
+  Stats stats_;
 
   micro::SizeCallback current_read_callback_;
   mjlib::base::string_span current_read_data_;
@@ -418,6 +541,14 @@ void Stm32G4AsyncUsbCdc::Poll() {
   impl_->Poll();
 }
 
+uint32_t Stm32G4AsyncUsbCdc::frame_count() const {
+  return impl_->frame_count();
+}
+
+const Stm32G4AsyncUsbCdc::Stats& Stm32G4AsyncUsbCdc::stats() const {
+  return impl_->stats();
+}
+
 /*
 void Stm32G4AsyncUsbCdc::Poll10Ms() {
   impl_->Poll10Ms();
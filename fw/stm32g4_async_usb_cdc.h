@@ -17,6 +17,7 @@
 #include "mbed.h"
 
 #include "mjlib/base/string_span.h"
+#include "mjlib/base/visitor.h"
 
 #include "mjlib/micro/async_stream.h"
 #include "mjlib/micro/pool_ptr.h"
@@ -27,6 +28,43 @@ class Stm32G4AsyncUsbCdc : public mjlib::micro::AsyncStream {
  public:
   struct Options {
   };
+
+  struct Stats {
+    /// Bytes and packets sent on the IN endpoint, not counting the
+    /// zero length packets sent while idle.
+    uint32_t tx_bytes = 0;
+    uint32_t tx_packets = 0;
+    /// The most bytes ever waiting in the transmit ring.
+    uint32_t tx_ring_peak = 0;
+    /// Polls where a write was waiting for room in the ring.
+    uint32_t tx_ring_waits = 0;
+
+    /// Bytes accepted from the OUT endpoint, and those dropped because
+    /// the receive ring was full.  The latter should stay at 0, as
+    /// packets are left in the endpoint until they fit.
+    uint32_t rx_bytes = 0;
+    uint32_t rx_overrun_bytes = 0;
+    /// The times a packet was left in the OUT endpoint, which NAKs the
+    /// host until the ring has room for it.
+    uint32_t rx_holds = 0;
+    /// The bytes in the receive ring now, and the most ever.
+    uint32_t rx_ring_fill = 0;
+    uint32_t rx_ring_peak = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(tx_bytes));
+      a->Visit(MJ_NVP(tx_packets));
+      a->Visit(MJ_NVP(tx_ring_peak));
+      a->Visit(MJ_NVP(tx_ring_waits));
+      a->Visit(MJ_NVP(rx_bytes));
+      a->Visit(MJ_NVP(rx_overrun_bytes));
+      a->Visit(MJ_NVP(rx_holds));
+      a->Visit(MJ_NVP(rx_ring_fill));
+      a->Visit(MJ_NVP(rx_ring_peak));
+    }
+  };
+
   Stm32G4AsyncUsbCdc(mjlib::micro::Pool*, const Options&);
   ~Stm32G4AsyncUsbCdc() override;
 
@@ -36,6 +74,12 @@ class Stm32G4AsyncUsbCdc : public mjlib::micro::AsyncStream {
                       const mjlib::micro::SizeCallback&) override;
 
   void Poll();
+
+  /// The number of USB start of frame events seen, one per
+  /// millisecond while the host is connected.
+  uint32_t frame_count() const;
+
+  const Stats& stats() const;
   //void Poll10Ms();
 
  private:
@@ -0,0 +1,95 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/stm32g4_deadline_timer.h"
+
+#include "mjlib/base/assert.h"
+
+namespace fw {
+
+namespace {
+Stm32G4DeadlineTimer* g_deadline_timer = nullptr;
+
+// Numerically larger is less urgent.  The DMA and EXTI interrupts
+// are left at the default of 0 so that they can preempt us.
+constexpr uint32_t kIrqPriority = 8;
+}
+
+Stm32G4DeadlineTimer::Stm32G4DeadlineTimer(Callback callback)
+    : callback_(callback) {
+  MJ_ASSERT(g_deadline_timer == nullptr);
+  g_deadline_timer = this;
+
+  TIM5->DIER &= ~TIM_DIER_CC1IE;
+  TIM5->SR = ~TIM_SR_CC1IF;
+  // Frozen output compare mode, we just want the flag.
+  TIM5->CCMR1 &= ~(TIM_CCMR1_OC1M | TIM_CCMR1_CC1S);
+
+  NVIC_SetVector(TIM5_IRQn,
+                 reinterpret_cast<uint32_t>(&Stm32G4DeadlineTimer::g_isr));
+  NVIC_SetPriority(TIM5_IRQn, kIrqPriority);
+  NVIC_EnableIRQ(TIM5_IRQn);
+}
+
+Stm32G4DeadlineTimer::~Stm32G4DeadlineTimer() {
+  Stop();
+  NVIC_DisableIRQ(TIM5_IRQn);
+
+  g_deadline_timer = nullptr;
+}
+
+void Stm32G4DeadlineTimer::Schedule(uint32_t deadline_us) {
+  CriticalSectionLock lock;
+
+  deadline_us_ = deadline_us;
+  armed_ = true;
+
+  TIM5->CCR1 = deadline_us;
+  TIM5->SR = ~TIM_SR_CC1IF;
+  TIM5->DIER |= TIM_DIER_CC1IE;
+
+  // The compare only fires on an exact match, so if the counter is
+  // already at or past the deadline we have to trigger it ourselves.
+  if (static_cast<int32_t>(TIM5->CNT - deadline_us) >= 0) {
+    NVIC_SetPendingIRQ(TIM5_IRQn);
+  }
+}
+
+void Stm32G4DeadlineTimer::Stop() {
+  CriticalSectionLock lock;
+
+  armed_ = false;
+  TIM5->DIER &= ~TIM_DIER_CC1IE;
+  TIM5->SR = ~TIM_SR_CC1IF;
+  NVIC_ClearPendingIRQ(TIM5_IRQn);
+}
+
+void Stm32G4DeadlineTimer::Isr() {
+  TIM5->SR = ~TIM_SR_CC1IF;
+
+  // We can be pended both by the compare and by Schedule, so only
+  // act once per deadline.
+  if (!armed_) { return; }
+
+  armed_ = false;
+  TIM5->DIER &= ~TIM_DIER_CC1IE;
+
+  callback_(deadline_us_);
+}
+
+void Stm32G4DeadlineTimer::g_isr() {
+  g_deadline_timer->Isr();
+}
+
+}
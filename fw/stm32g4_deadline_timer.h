@@ -0,0 +1,61 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "mbed.h"
+
+#include "mjlib/micro/static_function.h"
+
+namespace fw {
+
+/// Invokes a callback from interrupt context when the free running
+/// microsecond counter of MillisecondTimer (TIM5) reaches a given
+/// value.  This uses the TIM5 channel 1 compare, so deadlines are in
+/// the same time base as MillisecondTimer::read_us().
+///
+/// The interrupt runs at a lower priority than the DMA and EXTI
+/// interrupts, so the callback is allowed to perform blocking SPI
+/// transactions.  Anything it shares with the main loop must still
+/// be protected, for instance with CriticalSectionLock.
+class Stm32G4DeadlineTimer {
+ public:
+  /// Invoked with the deadline that was requested.
+  using Callback = mjlib::micro::StaticFunction<void(uint32_t)>;
+
+  Stm32G4DeadlineTimer(Callback);
+  ~Stm32G4DeadlineTimer();
+
+  /// Arrange for the callback to be invoked once at @p deadline_us.
+  /// Any previously scheduled deadline is replaced.  If the deadline
+  /// has already passed, the callback is invoked as soon as possible.
+  /// This may be called from interrupt context, including from the
+  /// callback itself.
+  void Schedule(uint32_t deadline_us);
+
+  /// Cancel any pending deadline.
+  void Stop();
+
+  static void g_isr();
+
+ private:
+  void Isr();
+
+  const Callback callback_;
+
+  volatile bool armed_ = false;
+  volatile uint32_t deadline_us_ = 0;
+};
+
+}
@@ -0,0 +1,147 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/stm32g4_dma_spi.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mjlib/base/assert.h"
+
+namespace fw {
+
+namespace {
+Stm32G4DmaSpi* g_dma_spi = nullptr;
+
+DMA_Channel_TypeDef* const kRxChannel = DMA1_Channel1;
+DMA_Channel_TypeDef* const kTxChannel = DMA1_Channel2;
+}
+
+Stm32G4DmaSpi::Stm32G4DmaSpi(PinName cs) : cs_(cs, 1) {
+  MJ_ASSERT(g_dma_spi == nullptr);
+  g_dma_spi = this;
+
+  __HAL_RCC_DMAMUX1_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  // DMA1 channel N is fed from DMAMUX1 channel N-1.
+  DMAMUX1_Channel0->CCR = DMA_REQUEST_SPI1_RX;
+  DMAMUX1_Channel1->CCR = DMA_REQUEST_SPI1_TX;
+
+  kRxChannel->CCR = 0;
+  kRxChannel->CPAR = reinterpret_cast<uint32_t>(&SPI1->DR);
+  kTxChannel->CCR = 0;
+  kTxChannel->CPAR = reinterpret_cast<uint32_t>(&SPI1->DR);
+
+  NVIC_SetVector(DMA1_Channel1_IRQn,
+                 reinterpret_cast<uint32_t>(&Stm32G4DmaSpi::g_dma_rx_complete));
+  NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+}
+
+Stm32G4DmaSpi::~Stm32G4DmaSpi() {
+  NVIC_DisableIRQ(DMA1_Channel1_IRQn);
+  kRxChannel->CCR = 0;
+  kTxChannel->CCR = 0;
+  SPI1->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+  cs_.write(1);
+
+  g_dma_spi = nullptr;
+}
+
+bool Stm32G4DmaSpi::Queue(const Transaction& transaction, bool reserved) {
+  MJ_ASSERT(transaction.tx.size() <= kMaxDataSize);
+  MJ_ASSERT(transaction.rx.size() <= kMaxDataSize);
+
+  CriticalSectionLock lock;
+
+  const int limit = reserved ? kQueueSize : (kQueueSize - kReservedSize);
+  if (count_ >= limit) { return false; }
+
+  auto& entry = queue_[(head_ + count_) % kQueueSize];
+  entry.command = transaction.command;
+  entry.tx_size = transaction.tx.size();
+  std::memcpy(entry.tx, transaction.tx.data(), transaction.tx.size());
+  entry.rx = transaction.rx;
+  entry.callback = transaction.callback;
+  count_ = count_ + 1;
+
+  StartNext();
+
+  return true;
+}
+
+void Stm32G4DmaSpi::StartNext() {
+  // This is only ever called with interrupts disabled or from the
+  // DMA interrupt itself.
+  if (active_ || count_ == 0) { return; }
+
+  active_ = true;
+
+  // mbed re-initializes the peripheral whenever the SPI format or
+  // frequency is changed, so re-assert our DMA configuration each
+  // time.  The requests do nothing until the channels are enabled.
+  SPI1->CR2 |= SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+  SPI1->CR1 |= SPI_CR1_SPE;
+
+  const auto& entry = queue_[head_];
+  size_ = 1 + std::max<int>(entry.tx_size, entry.rx.size());
+
+  tx_buf_[0] = entry.command;
+  std::memcpy(&tx_buf_[1], entry.tx, entry.tx_size);
+  std::memset(&tx_buf_[1 + entry.tx_size], 0, size_ - 1 - entry.tx_size);
+
+  cs_.write(0);
+
+  // The nrf24l01 has a 38ns CS setup time, which the channel
+  // programming below easily covers.
+  kRxChannel->CNDTR = size_;
+  kRxChannel->CMAR = reinterpret_cast<uint32_t>(&rx_buf_[0]);
+  kRxChannel->CCR = DMA_CCR_MINC | DMA_CCR_TCIE | DMA_CCR_EN;
+
+  kTxChannel->CNDTR = size_;
+  kTxChannel->CMAR = reinterpret_cast<uint32_t>(&tx_buf_[0]);
+  kTxChannel->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+}
+
+void Stm32G4DmaSpi::DmaRxComplete() {
+  DMA1->IFCR = DMA_IFCR_CGIF1;
+
+  kRxChannel->CCR = 0;
+  kTxChannel->CCR = 0;
+
+  // The final byte has been received, so the bus is idle.
+  cs_.write(1);
+
+  auto& entry = queue_[head_];
+  std::memcpy(entry.rx.data(), &rx_buf_[1], entry.rx.size());
+  const uint8_t status = rx_buf_[0];
+
+  auto callback = entry.callback;
+  entry.callback = {};
+  entry.rx = {};
+
+  head_ = (head_ + 1) % kQueueSize;
+  count_ = count_ - 1;
+  active_ = false;
+
+  if (callback) { callback(status); }
+
+  StartNext();
+}
+
+void Stm32G4DmaSpi::g_dma_rx_complete() {
+  g_dma_spi->DmaRxComplete();
+}
+
+}
@@ -0,0 +1,102 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <string_view>
+
+#include "mbed.h"
+
+#include "mjlib/base/string_span.h"
+#include "mjlib/micro/static_function.h"
+
+namespace fw {
+
+/// Runs a queue of SPI transactions on SPI1 using DMA1 channel 1 (RX)
+/// and channel 2 (TX).  Each transaction asserts CS, clocks out a
+/// command byte followed by optional data, then releases CS.  Queued
+/// transactions are started back to back from the DMA completion
+/// interrupt, so the CPU is only involved once per transaction.
+///
+/// SPI1 must already be configured (pins, format, and frequency),
+/// for instance by constructing an mbed SPI instance first.
+class Stm32G4DmaSpi {
+ public:
+  /// Invoked from interrupt context with the byte that was clocked in
+  /// while the command byte was sent.
+  using Callback = mjlib::micro::StaticFunction<void(uint8_t)>;
+
+  static constexpr int kMaxDataSize = 32;
+  static constexpr int kQueueSize = 8;
+  /// Entries which only reserved transactions may use.
+  static constexpr int kReservedSize = 3;
+
+  struct Transaction {
+    uint8_t command = 0;
+
+    /// This is copied when the transaction is queued.
+    std::string_view tx;
+
+    /// This must remain valid until the callback is invoked.
+    mjlib::base::string_span rx;
+
+    Callback callback;
+  };
+
+  Stm32G4DmaSpi(PinName cs);
+  ~Stm32G4DmaSpi();
+
+  /// Queue a transaction to be run after all currently queued ones.
+  /// This may be called from interrupt context, including from
+  /// within a completion callback.  @return false if the queue was
+  /// full.
+  ///
+  /// Unreserved transactions leave the last kReservedSize entries
+  /// free.  Those are for a single chain of transactions, each queued
+  /// from the callback of the one before, which can never wait for
+  /// room because it runs at the DMA interrupt priority.  Such a chain
+  /// must have no more than kReservedSize outstanding at once, and is
+  /// then guaranteed to succeed.
+  bool Queue(const Transaction&, bool reserved = false);
+
+  /// Return true if no transactions are queued or in progress.
+  bool idle() const { return count_ == 0; }
+
+  static void g_dma_rx_complete();
+
+ private:
+  struct Entry {
+    uint8_t command = 0;
+    uint8_t tx_size = 0;
+    char tx[kMaxDataSize] = {};
+    mjlib::base::string_span rx;
+    Callback callback;
+  };
+
+  void StartNext();
+  void DmaRxComplete();
+
+  DigitalOut cs_;
+
+  Entry queue_[kQueueSize] = {};
+  volatile int head_ = 0;
+  volatile int count_ = 0;
+  volatile bool active_ = false;
+
+  uint8_t tx_buf_[kMaxDataSize + 1] = {};
+  uint8_t rx_buf_[kMaxDataSize + 1] = {};
+  uint8_t size_ = 0;
+};
+
+}
@@ -0,0 +1,115 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fw/stm32g4_pulse_output.h"
+
+#include "PeripheralPins.h"
+#include "pinmap.h"
+
+#include "mjlib/base/assert.h"
+
+namespace fw {
+
+namespace {
+// Output compare modes, as the 4 bit OCxM value.
+constexpr uint32_t kForceInactive = 0x4;
+constexpr uint32_t kForceActive = 0x5;
+constexpr uint32_t kPwm2 = 0x7;
+
+// The counter value at which the pulse starts.  It must be non-zero
+// so that the output is inactive while the counter is stopped.
+constexpr uint32_t kPulseStart = 1;
+
+uint32_t GetTim1ClockFreq() {
+  // The timer clock is doubled whenever the APB2 prescaler is not 1.
+  const uint32_t pclk2 = HAL_RCC_GetPCLK2Freq();
+  return ((RCC->CFGR & RCC_CFGR_PPRE2) == RCC_HCLK_DIV1) ? pclk2 : 2 * pclk2;
+}
+}
+
+Stm32G4PulseOutput::Stm32G4PulseOutput(
+    PinName pin, int value, uint32_t pulse_width_us)
+    : timer_(reinterpret_cast<TIM_TypeDef*>(
+                 pinmap_peripheral(pin, PinMap_PWM))),
+      channel_(STM_PIN_CHANNEL(pinmap_function(pin, PinMap_PWM))) {
+  MJ_ASSERT(timer_ == TIM1);
+  MJ_ASSERT(channel_ >= 1 && channel_ <= 4);
+  MJ_ASSERT(!STM_PIN_INVERTED(pinmap_function(pin, PinMap_PWM)));
+  MJ_ASSERT(pulse_width_us >= 1 && pulse_width_us < 0xfff0);
+
+  __HAL_RCC_TIM1_CLK_ENABLE();
+
+  timer_->CR1 = TIM_CR1_OPM;
+  timer_->PSC = GetTim1ClockFreq() / 1000000 - 1;  // 1 us tick
+  // In PWM mode 2 the output is active from kPulseStart until the
+  // counter overflows, at which point one-pulse mode stops it.
+  timer_->CCR1 = kPulseStart;
+  timer_->CCR2 = kPulseStart;
+  timer_->CCR3 = kPulseStart;
+  timer_->CCR4 = kPulseStart;
+  timer_->ARR = kPulseStart + pulse_width_us - 1;
+  // Latch the prescaler without starting the counter.
+  timer_->EGR = TIM_EGR_UG;
+
+  write(value);
+
+  timer_->CCER |= (TIM_CCER_CC1E << ((channel_ - 1) * 4));
+  timer_->BDTR |= TIM_BDTR_MOE;
+
+  pin_function(pin, pinmap_function(pin, PinMap_PWM));
+}
+
+Stm32G4PulseOutput::~Stm32G4PulseOutput() {
+  timer_->CR1 &= ~TIM_CR1_CEN;
+  timer_->CCER &= ~(TIM_CCER_CC1E << ((channel_ - 1) * 4));
+}
+
+void Stm32G4PulseOutput::write(int value) {
+  CriticalSectionLock lock;
+
+  timer_->CR1 &= ~TIM_CR1_CEN;
+  timer_->CNT = 0;
+  SetMode(value ? kForceActive : kForceInactive);
+}
+
+void Stm32G4PulseOutput::Pulse() {
+  CriticalSectionLock lock;
+
+  timer_->CR1 &= ~TIM_CR1_CEN;
+  timer_->CNT = 0;
+  SetMode(kPwm2);
+  timer_->CR1 |= TIM_CR1_CEN;
+}
+
+bool Stm32G4PulseOutput::pulse_active() const {
+  return (timer_->CR1 & TIM_CR1_CEN) != 0;
+}
+
+void Stm32G4PulseOutput::SetMode(uint32_t mode) {
+  // OCxM is split, with bits 2:0 at bit 4 and bit 3 at bit 16, for
+  // the first channel of each CCMR register.
+  volatile uint32_t* const ccmr =
+      (channel_ <= 2) ? &timer_->CCMR1 : &timer_->CCMR2;
+  const int shift = ((channel_ - 1) % 2) * 8;
+  const uint32_t mask =
+      (TIM_CCMR1_OC1M_0 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1M_2 |
+       TIM_CCMR1_OC1M_3) << shift;
+  const uint32_t bits =
+      (((mode & 0x7) << TIM_CCMR1_OC1M_Pos) |
+       (((mode >> 3) & 0x1) << 16)) << shift;
+
+  *ccmr = (*ccmr & ~mask) | bits;
+}
+
+}
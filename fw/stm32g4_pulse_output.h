@@ -0,0 +1,52 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "mbed.h"
+
+namespace fw {
+
+/// A digital output which can also emit a fixed width pulse generated
+/// entirely in hardware.  The pin is driven from a TIM1 channel in
+/// one-pulse mode, so the pulse width does not depend upon interrupt
+/// or main loop latency.  Steady levels are produced using the
+/// forced output modes of the same channel.
+///
+/// The pin must be one of the TIM1 outputs listed in PinMap_PWM.
+class Stm32G4PulseOutput {
+ public:
+  Stm32G4PulseOutput(PinName pin, int value, uint32_t pulse_width_us);
+  ~Stm32G4PulseOutput();
+
+  /// Drive the output to a steady level, aborting any pulse in
+  /// progress.
+  void write(int value);
+
+  /// Emit a single pulse of the configured width, then return low.
+  /// This returns immediately and may be called from interrupt
+  /// context.
+  void Pulse();
+
+  /// Return true if a pulse is currently being emitted.
+  bool pulse_active() const;
+
+ private:
+  void SetMode(uint32_t mode);
+
+  TIM_TypeDef* const timer_;
+  const int channel_;
+};
+
+}